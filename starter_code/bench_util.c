@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_util.h"
+
+#define LINE_LEN 256
+
+/* Workload keywords of the single-key requests and the numbers each takes */
+static const struct {
+	const char *name;
+	enum REQUEST_TYPE type;
+	int args;
+} ops[] = {
+	{ "put", PUT, 2 },
+	{ "get", GET, 1 },
+	{ "incr", INCR, 2 },
+	{ "cas", CAS, 3 }, /* key expected new */
+	{ "getset", GETSET, 2 },
+};
+#define NUM_OPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+double now_us(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void sort_samples(double *samples, int n) {
+	qsort(samples, n, sizeof(double), cmp_double);
+}
+
+double percentile(double *sorted, int n, double p) {
+	int i = n * p;
+	return sorted[i < n ? i : n - 1];
+}
+
+int read_workload(const char *path, struct buffer_descriptor **reqs) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+	char line[LINE_LEN];
+	int n = 0, cap = 1024;
+	*reqs = malloc(cap * sizeof(struct buffer_descriptor));
+	while (*reqs != NULL && fgets(line, LINE_LEN, f) != NULL) {
+		char op[8];
+		unsigned int k, a = 0, b = 0;
+		int fields = sscanf(line, "%7s %u %u %u", op, &k, &a, &b);
+		/* Blank line - op was never written */
+		if (fields < 1)
+			continue;
+		int t = 0;
+		while (t < NUM_OPS && strcmp(op, ops[t].name))
+			t++;
+		if (t == NUM_OPS || fields < ops[t].args + 1)
+			continue;
+
+		if (n == cap) {
+			cap *= 2;
+			struct buffer_descriptor *grown = realloc(*reqs, cap * sizeof(struct buffer_descriptor));
+			if (grown == NULL) {
+				free(*reqs);
+				*reqs = NULL;
+				break;
+			}
+			*reqs = grown;
+		}
+		struct buffer_descriptor *bd = &(*reqs)[n++];
+		memset(bd, 0, sizeof(struct buffer_descriptor));
+		bd->req_type = ops[t].type;
+		bd->k = k;
+		bd->v = ops[t].type == CAS ? b : a;
+		bd->old = ops[t].type == CAS ? a : 0;
+	}
+	fclose(f);
+	if (*reqs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "common.h"
+#include "ring_buffer.h"
+
+/* Helpers shared by the benchmark programs */
+
+/* Monotonic clock in microseconds */
+double now_us(void);
+
+/* qsort comparator for an ascending array of doubles */
+int cmp_double(const void *a, const void *b);
+
+/*
+ * Sort n samples in place so that percentile can read them
+*/
+void sort_samples(double *samples, int n);
+
+/*
+ * @param sorted samples sorted by sort_samples
+ * @param p fraction of the samples at or below the result - 1 gives the max
+ * @return the p-th quantile of the n samples
+*/
+double percentile(double *sorted, int n, double p);
+
+/*
+ * Read the single-key requests (put, get, incr, cas, getset) of a workload
+ * file, in the client's syntax - any other line is skipped
+ * Exits if the file can't be read
+ * @param reqs set to a malloc'ed array with req_type, k, v and old of each
+ * request filled in and everything else zeroed
+ * @return the number of requests
+*/
+int read_workload(const char *path, struct buffer_descriptor **reqs);
@@ -51,6 +51,7 @@ int main(int argc, char *argv[]) {
 
         ring_submit(&r_2, &submit_bd);
         ring_get(&r_2, &get_bd);
+        ring_release(&r_2, &get_bd);
 
         if ((get_bd.k != submit_bd.k) ||
             (get_bd.v != submit_bd.v) ||
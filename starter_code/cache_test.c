@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "common.h"
+#include "kv_engine.h"
+
+/*
+ * Cache mode churn test - threads keep putting keys from a key space far
+ * larger than the capacity, so every insert evicts and shifts the entries
+ * after it back, and read back keys they wrote a little earlier. Each key
+ * only ever holds one value, so a get must return it or miss - anything else
+ * means an entry was lost or duplicated while it moved. Afterwards the table
+ * may hold at most capacity live entries (plus one per thread still over it)
+ * and no slot marked deleted.
+ * Usage: cache_test [-t threads] [-s table_size] [-c capacity] [-o ops_per_thread]
+*/
+
+#define MAX_THREADS 64
+#define LOOKBACK 64
+
+int num_threads = 4;
+int table_size = 4096;
+int capacity = 1024;
+int num_ops = 200000;
+pthread_t threads[MAX_THREADS];
+long wrong[MAX_THREADS];
+
+/* The only value key k is ever put with */
+static inline value_type value_of(key_type k) {
+	return k * 2654435761u | 1;
+}
+
+void *thread_function(void *arg) {
+	int t = (int)(long)arg;
+	struct buffer_descriptor bd;
+	/* Keys of different threads never collide, but share home slots */
+	key_type base = t * num_ops + 1;
+	for (int i = 0; i < num_ops; i++) {
+		memset(&bd, 0, sizeof(bd));
+		bd.req_type = PUT;
+		bd.k = base + i;
+		bd.v = value_of(bd.k);
+		process_request(&bd);
+
+		memset(&bd, 0, sizeof(bd));
+		bd.req_type = GET;
+		bd.k = base + (i >= LOOKBACK ? i - i % LOOKBACK : 0);
+		process_request(&bd);
+		if (bd.v != 0 && bd.v != value_of(bd.k))
+			wrong[t]++;
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "ht:s:c:o:")) != -1) {
+		switch (op) {
+		case 't':
+		num_threads = atoi(optarg);
+		break;
+
+		case 's':
+		table_size = atoi(optarg);
+		break;
+
+		case 'c':
+		capacity = atoi(optarg);
+		break;
+
+		case 'o':
+		num_ops = atoi(optarg);
+		break;
+
+		default:
+		printf("Usage: %s [-t threads] [-s table_size] [-c capacity] [-o ops_per_thread]\n", argv[0]);
+		exit(op == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (num_threads <= 0 || num_threads > MAX_THREADS || capacity <= 0 || capacity >= table_size ||
+			num_ops <= 0) {
+		printf("Need 1 to %d threads, 0 < capacity < table size and ops > 0\n", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
+
+	initialize_hashTable(table_size);
+	initialize_cache(capacity, 0);
+	for (long i = 0; i < num_threads; i++)
+		if (pthread_create(&threads[i], NULL, thread_function, (void *)i)) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	long total_wrong = 0;
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total_wrong += wrong[i];
+	}
+
+	int tombstones;
+	int live = cache_slot_stats(&tombstones);
+	int fail = 0;
+	if (total_wrong) {
+		printf("%ld gets returned a value their key was never put with\n", total_wrong);
+		fail = 1;
+	}
+	if (live > capacity + num_threads) {
+		printf("%d live entries, capacity is %d\n", live, capacity);
+		fail = 1;
+	}
+	if (tombstones) {
+		printf("%d tombstones and %d live entries in %d slots - a removal was left unfinished\n",
+				tombstones, live, table_size);
+		fail = 1;
+	}
+	print_cache_stats();
+	printf("%d live entries, %d tombstones in %d slots\n", live, tombstones, table_size);
+	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "capture.h"
+
+/* Records of one worker not written out yet - the lock is only ever
+ * contended by the exit flush */
+struct capture_buf {
+	pthread_mutex_t lock;
+	int n;
+	struct capture_record records[CAPTURE_BUF_RECORDS];
+};
+
+static int capture_fd = -1;
+static int capture_workers;
+static struct capture_buf *bufs;
+static uint64_t capture_start_ns;
+static const char *capture_shm;
+
+/* O_APPEND makes each write land whole at the end, whichever worker does it */
+static void flush_buf(struct capture_buf *b) {
+	if (b->n > 0 && write(capture_fd, b->records, b->n * sizeof(struct capture_record)) < 0)
+		perror("write capture");
+	b->n = 0;
+}
+
+static void add_record(struct capture_buf *b, uint64_t t_ns, enum REQUEST_TYPE type,
+		key_type k, value_type v, value_type old) {
+	if (b->n == CAPTURE_BUF_RECORDS)
+		flush_buf(b);
+	struct capture_record *r = &b->records[b->n++];
+	r->t_ns = t_ns;
+	r->k = k;
+	r->v = v;
+	r->old = old;
+	r->req_type = type;
+}
+
+/*
+ * Write out what every worker buffered - runs at exit, while workers may
+ * still be serving. A lock that stays taken (e.g. the exiting thread is a
+ * worker interrupted mid-append) is given up on after a while
+*/
+static void flush_all(void) {
+	for (int i = 0; i < capture_workers; i++) {
+		int tries = 0;
+		while (pthread_mutex_trylock(&bufs[i].lock) != 0 && ++tries < 1000)
+			usleep(10);
+		if (tries < 1000) {
+			flush_buf(&bufs[i]);
+			pthread_mutex_unlock(&bufs[i].lock);
+		}
+	}
+}
+
+int capture_start(const char *path, int workers, const char *shm) {
+	capture_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (capture_fd < 0) {
+		perror("open capture file");
+		return -1;
+	}
+	if (write(capture_fd, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) < 0) {
+		perror("write capture");
+		return -1;
+	}
+	bufs = calloc(workers, sizeof(struct capture_buf));
+	if (bufs == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	for (int i = 0; i < workers; i++)
+		pthread_mutex_init(&bufs[i].lock, NULL);
+	capture_workers = workers;
+	capture_shm = shm;
+	capture_start_ns = now_ns();
+	atexit(flush_all);
+	return 0;
+}
+
+void capture_append(int worker, struct buffer_descriptor *bds, int n) {
+	if (capture_fd < 0)
+		return;
+
+	/* One timestamp for the whole batch - it was dequeued in one go */
+	uint64_t t_ns = now_ns();
+	struct capture_buf *b = &bufs[worker];
+	pthread_mutex_lock(&b->lock);
+	t_ns -= capture_start_ns;
+	for (int i = 0; i < n; i++) {
+		struct buffer_descriptor *bd = &bds[i];
+		if (bd->req_type != MGET && bd->req_type != MPUT) {
+			add_record(b, t_ns, bd->req_type, bd->k, bd->v, bd->old);
+			continue;
+		}
+		/* A record has no room for a batch array - one per key instead */
+		struct kv_pair *pairs = (struct kv_pair *)(capture_shm + bd->batch_off);
+		for (uint32_t j = 0; j < bd->batch_len; j++)
+			add_record(b, t_ns, bd->req_type == MGET ? GET : PUT, pairs[j].k, pairs[j].v, 0);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+static int cmp_record(const void *a, const void *b) {
+	uint64_t x = ((const struct capture_record *)a)->t_ns;
+	uint64_t y = ((const struct capture_record *)b)->t_ns;
+	return (x > y) - (x < y);
+}
+
+int capture_read(const char *path, struct capture_record **records) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen capture file");
+		return -1;
+	}
+	char magic[sizeof(CAPTURE_MAGIC)] = { 0 };
+	struct stat st;
+	if (fread(magic, 1, strlen(CAPTURE_MAGIC), f) != strlen(CAPTURE_MAGIC) ||
+			strcmp(magic, CAPTURE_MAGIC) || fstat(fileno(f), &st) < 0) {
+		fprintf(stderr, "%s is not a capture file\n", path);
+		fclose(f);
+		return -1;
+	}
+
+	/* A record cut short by a killed server is dropped */
+	int n = (st.st_size - strlen(CAPTURE_MAGIC)) / sizeof(struct capture_record);
+	*records = malloc((n > 0 ? n : 1) * sizeof(struct capture_record));
+	if (*records == NULL) {
+		perror("malloc");
+		fclose(f);
+		return -1;
+	}
+	n = fread(*records, sizeof(struct capture_record), n, f);
+	fclose(f);
+
+	/* Each worker's records are in order, but the workers' are interleaved */
+	qsort(*records, n, sizeof(struct capture_record), cmp_record);
+	return n;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include "common.h"
+#include "ring_buffer.h"
+
+/* First bytes of a capture file */
+#define CAPTURE_MAGIC "KVCAP001"
+/* Records a worker buffers before it writes them out */
+#define CAPTURE_BUF_RECORDS 4096
+
+/* One dequeued request - records of different workers are interleaved in
+ * the file, so a reader has to sort them by t_ns */
+struct __attribute__((packed)) capture_record {
+	uint64_t t_ns; /* dequeue time, relative to capture_start */
+	key_type k;
+	value_type v;
+	value_type old; /* CAS: expected value */
+	uint8_t req_type;
+};
+
+/*
+ * Start capturing into path (server -C), truncating it
+ * @param workers number of workers that will call capture_append
+ * @param shm start of the shared memory, which batch_off of MGET/MPUT
+ * requests is relative to
+ * @return 0 on success, -1 otherwise
+*/
+int capture_start(const char *path, int workers, const char *shm);
+
+/*
+ * Record a batch of requests a worker just took from the ring - no-op unless
+ * capture_start ran. Records go to a per-worker buffer that is written out
+ * when full and at exit. An MGET/MPUT is recorded as one GET/PUT per key
+ * @param worker the worker's id, below the count given to capture_start
+*/
+void capture_append(int worker, struct buffer_descriptor *bds, int n);
+
+/*
+ * Read a whole capture file, sorted by time
+ * @param records set to a malloc'ed array of the records
+ * @return the number of records, -1 on error
+*/
+int capture_read(const char *path, struct capture_record **records);
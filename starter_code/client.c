@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/mman.h>
 #include <pthread.h>
@@ -9,24 +10,54 @@
 #include <time.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 
 #include "common.h"
 #include "ring_buffer.h"
+#include "capture.h"
 
 #define MAX_THREADS 128
-#define LINE_LEN 256
+/* Long enough for an mget/mput line with MAX_MULTI_KEYS keys */
+#define LINE_LEN 1536
 
 #define PUT_STR "put"
 #define GET_STR "get"
 #define DEL_STR "del"
+#define INCR_STR "incr"
+#define CAS_STR "cas"
+#define GETSET_STR "getset"
+#define MGET_STR "mget"
+#define MPUT_STR "mput"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define MAX_EXTRA_ARGS 16
+
+/* Trace mode (-T) - per-stage latency histograms with power of two buckets,
+ * bucket b counts latencies in [2^(b-1), 2^b) ns */
+enum STAGE {
+	STAGE_QUEUE = 0, /* submit -> dequeued by a server worker */
+	STAGE_SERVICE,   /* dequeue -> table op done (includes bucket lock waits) */
+	STAGE_COMPLETION, /* table op done -> completion seen by the client */
+	STAGE_TOTAL,
+	NUM_STAGES
+};
+#define HIST_BUCKETS 48
+
+/* Completions taken from a completion queue at a time (-q) */
+#define REAP_BATCH 64
 
 #define READY 1
-#define NOT_READY 0
 
 struct request {
 	key_type k;
 	value_type v;
 	enum REQUEST_TYPE t;
+	uint32_t ttl_ms; /* optional 4th field of a put line (cache mode) */
+	value_type old; /* cas: expected value ("cas key expected new") */
+	uint32_t nkeys; /* mget/mput: number of pairs */
+	struct kv_pair *pairs; /* mget/mput: the keys (and values), mget results land here */
 };
 
 struct thread_context {
@@ -38,6 +69,15 @@ struct thread_context {
 	int win_size;
 	int nxt_comp; /* next completion that we're expecting */
 	int comp_off; /* byte offset of the status board for this thread, w.r.t the start of the shared memory area */
+	struct completion_queue *cq; /* completion queue in place of the status board (only with -q) */
+	uint32_t cq_head; /* next completion queue position to reap */
+	uint64_t *inv_ns; /* submit time of each request in reqs (only with -H) */
+	uint64_t *resp_ns; /* time each completion was seen (only with -H) */
+	uint64_t *arrival_ns; /* when each request is due, from the start of the run (only with -P) */
+	uint64_t hist[NUM_STAGES][HIST_BUCKETS]; /* only with -T */
+	int scratch_off; /* byte offset of this thread's batch arrays for mget/mput */
+	int *free_slots; /* batch arrays not used by an in-flight mget/mput */
+	int num_free;
 };
 
 struct ring *ring = NULL;
@@ -45,21 +85,38 @@ char *shmem_area = NULL;
 char shm_file[] = "shmem_file";
 char workload_file[256];
 char expected_file[256];
+char history_file[256]; /* -H: history of the run for lin_check */
+char replay_file[256]; /* -P: server capture (-C) to replay instead of a workload */
 pthread_t threads[MAX_THREADS];
 struct thread_context contexts[MAX_THREADS];
 struct request *requests;
 struct buffer_descriptor *results;
+uint64_t *inv_times;
+uint64_t *resp_times;
+uint64_t *arrival_times; /* only with -P */
+uint64_t replay_start_ns;
+double replay_speed = 1; /* -S: 1 replays at the captured pace, 0 as fast as possible */
 int num_threads = 4;
 int win_size = 1;
 int num_requests = 4;
+int num_keys = 0; /* keys in the workload - more than requests if it has mget/mput */
+int max_multi_keys = 0; /* most keys of an mget/mput in the workload */
 int verbose = 0;
 int child_pid = -1;
+int standby_pid = -1; /* hot standby forked with -r */
+int replicate = 0;
+int trace_every = 0; /* trace one in this many requests (-T), 0 = off */
+int kill_after_ms = 0; /* SIGKILL the primary after this long to test failover (-k) */
 int do_fork = 0;
+int use_memfd = 0;
+int shm_fd = -1; /* memfd handed to the forked server with -d (only with -m) */
 int validate = 0;
+int use_cq = 0; /* completion queues instead of status boards (-q) */
 
 /* Server arguments */
 int s_num_threads = 1;
 int s_init_table_size = 1000;
+char s_extra_args[LINE_LEN]; /* passed through to the server, split on spaces */
 
 /* prints "Client" before each line of output because the child will also be printing
  * to the same terminal */
@@ -67,13 +124,15 @@ int s_init_table_size = 1000;
 
 /*
  * Fork the server program as a child process
+ * @param repl_arg replication role for the server ("-r" or "-R pid"), or NULL
+ * @return the pid of the child
 */
-void fork_server() {
+pid_t fork_server(char *repl_arg) {
 	pid_t pid = fork();
 	
 	if (pid == 0) { /* The child process */
 		/* number of arguments including the NULL pointer at the end */
-		const int NUM_ARGS = 5;
+		const int NUM_ARGS = 6 + MAX_EXTRA_ARGS;
 		const int MAX_ARG_LEN = 256;
 		char **argv = malloc(NUM_ARGS * sizeof(char *));
 		if (argv == NULL)
@@ -89,19 +148,109 @@ void fork_server() {
 		strcpy(argv[idx++], "./server");
 		sprintf(argv[idx++], "-s %d", s_init_table_size);
 		sprintf(argv[idx++], "-n %d", s_num_threads);
+		if (shm_fd >= 0)
+			sprintf(argv[idx++], "-d %d", shm_fd);
 		if (verbose)
 			sprintf(argv[idx++], "-v");
+		if (repl_arg != NULL)
+			strcpy(argv[idx++], repl_arg);
+		for (char *tok = strtok(s_extra_args, " "); tok != NULL && idx < NUM_ARGS - 1;
+				tok = strtok(NULL, " "))
+			strncpy(argv[idx++], tok, MAX_ARG_LEN - 1);
 		argv[idx++] = NULL;
 		execvp("./server", argv);
 
 		/* Will only reach here if there's an error with execvp */
 		perror("execvp");
 	}
-	else if (pid > 0) { /* The parent process if there was no error */
-		child_pid = pid;
-	} else { /* The parent process in case of an error with fork */
+	else if (pid < 0) { /* The parent process in case of an error with fork */
 		perror("fork");
 	}
+	return pid;
+}
+
+/*
+ * Fork the primary server, and with -r a standby that follows it
+*/
+void fork_servers() {
+	if (!replicate) {
+		child_pid = fork_server(NULL);
+		return;
+	}
+	char standby_arg[32];
+	child_pid = fork_server("-r");
+	sprintf(standby_arg, "-R %d", child_pid);
+	standby_pid = fork_server(standby_arg);
+}
+
+/* Kills the primary mid-run, the standby has to finish the workload */
+void *killer_function(void *arg) {
+	(void)arg;
+	usleep(kill_after_ms * 1000);
+	printf("Killing primary server %d\n", child_pid);
+	kill(child_pid, SIGKILL);
+	return NULL;
+}
+
+/*
+ * Map an anonymous shared memory region of at least *size bytes from a memfd
+ * Tries hugetlbfs pages first (size is rounded up to a huge page) and falls
+ * back to regular shmem pages, which only get a transparent huge page hint
+ * Sets the shm_fd global variable to the memfd backing the region
+ * @return the prefaulted mapping on success, MAP_FAILED otherwise
+*/
+char *map_memfd(int *size) {
+	int huge_size = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	char *mem = MAP_FAILED;
+
+	shm_fd = memfd_create(shm_file, MFD_HUGETLB);
+	if (shm_fd >= 0 && ftruncate(shm_fd, huge_size) == 0)
+		mem = mmap(NULL, huge_size, PROT_WRITE | PROT_READ, MAP_SHARED | MAP_POPULATE, shm_fd, 0);
+	if (mem != MAP_FAILED) {
+		*size = huge_size;
+		return mem;
+	}
+	if (shm_fd >= 0)
+		close(shm_fd);
+
+	PRINTV("No hugetlb pages available, using regular shmem pages\n");
+	shm_fd = memfd_create(shm_file, 0);
+	if (shm_fd < 0) {
+		perror("memfd_create");
+		return MAP_FAILED;
+	}
+	if (ftruncate(shm_fd, *size) == -1) {
+		perror("ftruncate");
+		close(shm_fd);
+		shm_fd = -1;
+		return MAP_FAILED;
+	}
+
+	mem = mmap(NULL, *size, PROT_WRITE | PROT_READ, MAP_SHARED | MAP_POPULATE, shm_fd, 0);
+	if (mem == MAP_FAILED)
+		return MAP_FAILED;
+	madvise(mem, *size, MADV_HUGEPAGE);
+	return mem;
+}
+
+/*
+ * Bytes of shared memory each thread gets for its completions - a status
+ * board of win_size slots, or with -q a completion queue (rounded to cache
+ * lines so the queues of different threads don't share one)
+*/
+int comp_area_size() {
+	if (use_cq)
+		return (cq_bytes(win_size) + 63) & ~63;
+	return win_size * sizeof(struct buffer_descriptor);
+}
+
+/*
+ * Bytes of shared memory each thread gets for mget/mput batch arrays - one
+ * array of max_multi_keys pairs per window slot, nothing if the workload has
+ * no multi-key requests
+*/
+int scratch_area_size() {
+	return win_size * max_multi_keys * sizeof(struct kv_pair);
 }
 
 /*
@@ -110,37 +259,52 @@ void fork_server() {
  * Sets the ring global variable the beginning of the shared region 
  * Shared memory area is organized as follows:
  * | RING | TID_0_COMPLETIONS | TID_1_COMPLETIONS | ... | TID_N_COMPLETIONS |
+ *     | TID_0_BATCH_ARRAYS | ... | TID_N_BATCH_ARRAYS |
+ * where each TID_X_COMPLETIONS is a status board, or with -q a completion queue
+ * With -m the region lives in an anonymous memfd instead of shmem_file, so
+ * dirty pages are never written back to disk; the fd is passed to the forked
+ * server. Both mappings are prefaulted so page faults stay out of the timed run.
 */
 int init_client() {
-	int shm_size = sizeof(struct ring) + 
-		num_threads * win_size * sizeof(struct buffer_descriptor);
-	
-	int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-	if (fd < 0)
-		perror("open");
+	int shm_size = sizeof(struct ring) + num_threads * (comp_area_size() + scratch_area_size());
+	char *mem;
 
-	/* Make the file length exactly shm_size bytes */
-	if (ftruncate(fd, shm_size) == -1)
-		perror("ftruncate");
+	if (use_memfd) {
+		mem = map_memfd(&shm_size);
+	} else {
+		int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd < 0)
+			perror("open");
 
-	char *mem = mmap(NULL, shm_size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
-	if (mem == (void *)-1) 
-		perror("mmap");
+		/* Make the file length exactly shm_size bytes */
+		if (ftruncate(fd, shm_size) == -1)
+			perror("ftruncate");
+
+		mem = mmap(NULL, shm_size, PROT_WRITE | PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
 
-	/* mmap dups the fd, no longer needed */
-	close(fd);
+		/* mmap dups the fd, no longer needed */
+		close(fd);
+	}
+	if (mem == (void *)-1) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
 
 	memset(mem, 0, shm_size);
 	ring = (struct ring *)mem;
 	shmem_area = mem;
 	int ring_rc = -1;
-	if (ring_rc = init_ring(ring) < 0) {
+	if ((ring_rc = init_ring(ring)) < 0) {
 		printf("Ring initialization failed with %d as return code\n", ring_rc);
 		exit(EXIT_FAILURE);
 	}
+	if (use_cq)
+		for (int i = 0; i < num_threads; i++)
+			cq_init((struct completion_queue *)(mem + sizeof(struct ring) + i * comp_area_size()), win_size);
 
 	if (do_fork)
-		fork_server();
+		fork_servers();
+	return 0;
 }
 
 /*
@@ -154,12 +318,58 @@ int get_req_type(char *req_str, enum REQUEST_TYPE *type) {
 		*type = PUT;
 	else if (!strcmp(req_str, GET_STR))
 		*type = GET;
+	else if (!strcmp(req_str, INCR_STR))
+		*type = INCR;
+	else if (!strcmp(req_str, CAS_STR))
+		*type = CAS;
+	else if (!strcmp(req_str, GETSET_STR))
+		*type = GETSET;
+	else if (!strcmp(req_str, MGET_STR))
+		*type = MGET;
+	else if (!strcmp(req_str, MPUT_STR))
+		*type = MPUT;
 	else
 		rc = -1;
 
 	return rc;
 }
 
+/*
+ * Parses the rest of an mget ("mget k1 k2 ...") or mput ("mput k1 v1 k2 v2
+ * ...") line, whose first token strtok already consumed
+ * @return 0 on success, -1 on failure (including more than MAX_MULTI_KEYS
+ * keys)
+*/
+int add_multi_to_req(enum REQUEST_TYPE type, int index) {
+	struct kv_pair pairs[MAX_MULTI_KEYS];
+	int n = 0;
+	char *tok;
+	while (n < MAX_MULTI_KEYS && (tok = strtok(NULL, " \n")) != NULL) {
+		pairs[n].k = atoi(tok);
+		pairs[n].v = 0;
+		if (type == MPUT) {
+			tok = strtok(NULL, " \n");
+			if (tok == NULL)
+				return -1;
+			pairs[n].v = atoi(tok);
+		}
+		n++;
+	}
+	/* More keys than a request can carry */
+	if (n == 0 || (n == MAX_MULTI_KEYS && strtok(NULL, " \n") != NULL))
+		return -1;
+
+	requests[index].pairs = malloc(n * sizeof(struct kv_pair));
+	if (requests[index].pairs == NULL)
+		perror("malloc");
+	memcpy(requests[index].pairs, pairs, n * sizeof(struct kv_pair));
+	requests[index].nkeys = n;
+	requests[index].k = pairs[0].k;
+	if (n > max_multi_keys)
+		max_multi_keys = n;
+	return 0;
+}
+
 /* 
  * Parses an input line and stores the result into requests at index
  * @return 0 on success, -1 on failure
@@ -175,6 +385,11 @@ int add_line_to_req(char *line, int index) {
 		return -1;
 
 	requests[index].t = type;
+	requests[index].ttl_ms = 0;
+	requests[index].old = 0;
+	requests[index].nkeys = 0;
+	if (type == MGET || type == MPUT)
+		return add_multi_to_req(type, index);
 
 	tok = strtok(NULL, " ");
 	if (tok == NULL)
@@ -184,13 +399,24 @@ int add_line_to_req(char *line, int index) {
 	requests[index].k = key;
 
 	int value;
-	if (type == PUT) {
+	if (type == CAS) {
+		tok = strtok(NULL, " ");
+		if (tok == NULL)
+			return -1;
+
+		requests[index].old = atoi(tok);
+	}
+	if (type != GET) {
 		tok = strtok(NULL, " ");
 		if (tok == NULL)
 			return -1;
 
 		value = atoi(tok);
 		requests[index].v = value;
+
+		tok = strtok(NULL, " ");
+		if (tok != NULL)
+			requests[index].ttl_ms = atoi(tok);
 	}
 	return 0;
 }
@@ -198,13 +424,8 @@ int add_line_to_req(char *line, int index) {
 int count_lines(FILE *f) {
 	char line[LINE_LEN];
 	int nl = 0;
-	while(!feof(f)) {
-		fgets(line, LINE_LEN, f);
-		/* This prevents the last line from being read twice */
-		if (feof(f))
-			break;
+	while (fgets(line, LINE_LEN, f) != NULL)
 		nl++;
-	}
 	fseek(f, 0, SEEK_SET);
 	return nl;
 }
@@ -230,18 +451,71 @@ void read_input_files() {
 	results = malloc(num_requests * sizeof(struct buffer_descriptor));
 	if (results == NULL)
 		perror("malloc");
+	if (history_file[0]) {
+		inv_times = malloc(num_requests * sizeof(uint64_t));
+		resp_times = malloc(num_requests * sizeof(uint64_t));
+		if (inv_times == NULL || resp_times == NULL)
+			perror("malloc");
+	}
 
 	/* Read line by line and fill up the requests array
 	 * Ignores invalid lines */
 	char line[LINE_LEN];
 	int index = 0;
-	while (!feof(f)) {
-		fgets(line, LINE_LEN, f);
+	while (index < num_requests && fgets(line, LINE_LEN, f) != NULL) {
 		if (add_line_to_req(line, index) < 0)
 			continue;
 		
+		num_keys += requests[index].nkeys ? requests[index].nkeys : 1;
 		index++;
 	}
+	num_requests = index;
+	fclose(f);
+}
+
+/*
+ * Reads the capture in replay_file into the requests array instead
+ * Requests are dealt round robin to the threads, so that every thread
+ * replays the whole capture window, and each gets its capture time relative
+ * to the first request, scaled by replay_speed
+*/
+void read_capture_file() {
+	struct capture_record *records;
+	int n = capture_read(replay_file, &records);
+	if (n <= 0) {
+		fprintf(stderr, "Nothing to replay in %s\n", replay_file);
+		exit(EXIT_FAILURE);
+	}
+	num_requests = n;
+	num_keys = n;
+	requests = malloc(num_requests * sizeof(struct request));
+	results = malloc(num_requests * sizeof(struct buffer_descriptor));
+	arrival_times = malloc(num_requests * sizeof(uint64_t));
+	if (requests == NULL || results == NULL || arrival_times == NULL)
+		perror("malloc");
+	if (history_file[0]) {
+		inv_times = malloc(num_requests * sizeof(uint64_t));
+		resp_times = malloc(num_requests * sizeof(uint64_t));
+		if (inv_times == NULL || resp_times == NULL)
+			perror("malloc");
+	}
+
+	/* Records left over by the even split are dropped, like workload lines */
+	int reqs_per_th = num_requests / num_threads;
+	for (int j = 0; j < reqs_per_th * num_threads; j++) {
+		int index = (j % num_threads) * reqs_per_th + j / num_threads;
+		requests[index].t = records[j].req_type;
+		requests[index].k = records[j].k;
+		requests[index].v = records[j].v;
+		requests[index].old = records[j].old;
+		requests[index].ttl_ms = 0;
+		requests[index].nkeys = 0;
+		arrival_times[index] = replay_speed > 0 ?
+			(records[j].t_ns - records[0].t_ns) / replay_speed : 0;
+	}
+	printf("Replay: %d requests captured over %.1f ms, speed %g (0 = max)\n", num_requests,
+			(records[n - 1].t_ns - records[0].t_ns) / 1e6, replay_speed);
+	free(records);
 }
 
 /*
@@ -259,12 +533,34 @@ void submit_reqs(struct thread_context *ctx, int *last_completed, int *last_subm
 		/* Have we submitted all of the requests? */
 		if (*last_submitted >= ctx->num_reqs)
 			break;
+		/* Replay (-P): not due yet, keep reaping until it is */
+		if (ctx->arrival_ns && now_ns() - replay_start_ns < ctx->arrival_ns[i])
+			break;
 
 		memset(&bd, 0, sizeof(struct buffer_descriptor));
 		bd.k = reqs[i].k;
 		bd.v = reqs[i].v;
 		bd.req_type = reqs[i].t;
-		bd.res_off = ctx->comp_off + (*last_submitted % win_size) * sizeof(struct buffer_descriptor);
+		bd.ttl_ms = reqs[i].ttl_ms;
+		bd.old = reqs[i].old;
+		if (reqs[i].nkeys) {
+			/* Any free batch array will do - one per window slot */
+			int slot = ctx->free_slots[--ctx->num_free];
+			bd.batch_off = ctx->scratch_off + slot * max_multi_keys * sizeof(struct kv_pair);
+			bd.batch_len = reqs[i].nkeys;
+			memcpy(shmem_area + bd.batch_off, reqs[i].pairs, reqs[i].nkeys * sizeof(struct kv_pair));
+		}
+		/* Nonzero, so that a standby never mistakes an empty slot for it */
+		bd.id = i + 1;
+		if (use_cq) {
+			bd.cq_off = ctx->comp_off;
+		} else {
+			bd.res_off = ctx->comp_off + (*last_submitted % win_size) * sizeof(struct buffer_descriptor);
+		}
+		if (ctx->inv_ns)
+			ctx->inv_ns[i] = now_ns();
+		if (trace_every && i % trace_every == 0)
+			bd.t_submit = now_ns();
 		ring_submit(ring, &bd);
 		(*last_submitted)++;
 
@@ -272,6 +568,35 @@ void submit_reqs(struct thread_context *ctx, int *last_completed, int *last_subm
 	}
 }
 
+static inline void hist_add(uint64_t *hist, uint64_t ns) {
+	int b = ns ? 64 - __builtin_clzll(ns) : 0;
+	hist[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+}
+
+/*
+ * Account a traced request to the stage histograms of this thread
+ * @param bd the completion, as written back by the server
+ * @param seen when the client noticed it
+*/
+void trace_completion(struct thread_context *ctx, struct buffer_descriptor *bd, uint64_t seen) {
+	hist_add(ctx->hist[STAGE_QUEUE], bd->t_dequeue - bd->t_submit);
+	hist_add(ctx->hist[STAGE_SERVICE], bd->t_applied - bd->t_dequeue);
+	hist_add(ctx->hist[STAGE_COMPLETION], seen - bd->t_applied);
+	hist_add(ctx->hist[STAGE_TOTAL], seen - bd->t_submit);
+}
+
+/*
+ * Collect the results of a completed mget and release its batch array
+ * @param req the request
+ * @param bd its completion
+*/
+void finish_multi(struct thread_context *ctx, struct request *req, struct buffer_descriptor *bd) {
+	if (req->t == MGET)
+		memcpy(req->pairs, shmem_area + bd->batch_off, req->nkeys * sizeof(struct kv_pair));
+	ctx->free_slots[ctx->num_free++] = (bd->batch_off - ctx->scratch_off) /
+		(max_multi_keys * sizeof(struct kv_pair));
+}
+
 /*
  * Check possible completions in the request status board
  * Updates last_completed if there are any new completions
@@ -280,18 +605,26 @@ void submit_reqs(struct thread_context *ctx, int *last_completed, int *last_subm
  * @param last_submitted last request that was submitted
 */
 void process_completions(struct thread_context *ctx, int *last_completed, int *last_submitted) {
+	(void)last_submitted;
 	/* Check completions until we break */
 	while (true) {
 		/* We're expecting ctx->nxt_comp to be completed. If that's not
 		 * completed, we're done for now. Otherwise, process that and 
 		 * check the next one.
 		 * Notice that we're only allowing 'in-order acknowledgements'. */
-		if (ctx->comps[ctx->nxt_comp].ready == READY) {
+		if (__atomic_load_n(&ctx->comps[ctx->nxt_comp].ready, __ATOMIC_ACQUIRE) == READY) {
+			if (ctx->resp_ns)
+				ctx->resp_ns[*last_completed] = now_ns();
 			struct buffer_descriptor tmp = ctx->comps[ctx->nxt_comp];
+			if (tmp.t_submit)
+				trace_completion(ctx, &tmp, now_ns());
 			PRINTV("New completion: %u %u\n", tmp.k, tmp.v);
-			ctx->comps[ctx->nxt_comp].ready = NOT_READY;
+			/* Not 0 - a standby then knows this completion was posted */
+			ctx->comps[ctx->nxt_comp].ready = RESULT_TAKEN;
 			memcpy(&ctx->res[*last_completed], &ctx->comps[ctx->nxt_comp],
 				       	sizeof(struct buffer_descriptor));
+			if (ctx->reqs[*last_completed].nkeys)
+				finish_multi(ctx, &ctx->reqs[*last_completed], &tmp);
 
 			/* Update for the next iteration */
 			(*last_completed)++;
@@ -303,6 +636,40 @@ void process_completions(struct thread_context *ctx, int *last_completed, int *l
 	}
 }
 
+/*
+ * Reap every completion posted to this thread's completion queue (-q)
+ * Completions arrive in whatever order the server finished the requests -
+ * each one is filed under the request id it was submitted with, and
+ * last_completed counts them. Entries of id 0 only fill holes a dead server
+ * left (see ring_recover) and are skipped
+ * @param ctx context for this thread
+ * @param last_completed number of requests completed so far
+ * @param last_submitted last request that was submitted
+*/
+void reap_completions(struct thread_context *ctx, int *last_completed, int *last_submitted) {
+	(void)last_submitted;
+	struct buffer_descriptor done[REAP_BATCH];
+	int n;
+	do {
+		n = cq_reap(ctx->cq, &ctx->cq_head, done, REAP_BATCH);
+		uint64_t seen = n && (ctx->resp_ns || trace_every) ? now_ns() : 0;
+		for (int i = 0; i < n; i++) {
+			if (done[i].id == 0)
+				continue;
+			(*last_completed)++;
+			uint32_t id = done[i].id - 1;
+			if (ctx->resp_ns)
+				ctx->resp_ns[id] = seen;
+			if (done[i].t_submit)
+				trace_completion(ctx, &done[i], seen);
+			PRINTV("New completion: %u %u\n", done[i].k, done[i].v);
+			memcpy(&ctx->res[id], &done[i], sizeof(struct buffer_descriptor));
+			if (ctx->reqs[id].nkeys)
+				finish_multi(ctx, &ctx->reqs[id], &done[i]);
+		}
+	} while (n == REAP_BATCH);
+}
+
 /* 
  * Function that's run by each thread
  * @param arg context for this thread
@@ -311,17 +678,19 @@ void *thread_function(void *arg) {
 	struct thread_context *ctx = arg;
 	int last_completed = 0;
 	int last_submitted = 0;
+	void (*complete)(struct thread_context *, int *, int *) = use_cq ? reap_completions : process_completions;
 	PRINTV("Num reqs is %d\n", ctx->num_reqs);
 	/* Keep submitting the requests and processing the completions */
 	for (; last_submitted < ctx->num_reqs; ) {
 		submit_reqs(ctx, &last_completed, &last_submitted);	
-		process_completions(ctx, &last_completed, &last_submitted);
+		complete(ctx, &last_completed, &last_submitted);
 	}
 
 	PRINTV("Done with subs\n");
 	/* There might be some completions still in flight */
 	while (last_completed < ctx->num_reqs)
-		process_completions(ctx, &last_completed, &last_submitted);
+		complete(ctx, &last_completed, &last_submitted);
+	return NULL;
 }
 
 /*
@@ -344,10 +713,22 @@ void start_threads() {
 		contexts[i].num_reqs = reqs_per_th;
 		contexts[i].reqs = r;
 		contexts[i].win_size = win_size;
-		contexts[i].comps = (struct buffer_descriptor *) (shmem_area + sizeof(struct ring) + i * win_size * sizeof(struct buffer_descriptor));
-		contexts[i].res = rs;
 		/* This is the byte offset to the first window for this thread */
-		contexts[i].comp_off = sizeof(struct ring) + contexts[i].tid * win_size * sizeof(struct buffer_descriptor);
+		contexts[i].comp_off = sizeof(struct ring) + contexts[i].tid * comp_area_size();
+		contexts[i].comps = (struct buffer_descriptor *) (shmem_area + contexts[i].comp_off);
+		contexts[i].cq = (struct completion_queue *) (shmem_area + contexts[i].comp_off);
+		contexts[i].scratch_off = sizeof(struct ring) + num_threads * comp_area_size() +
+			contexts[i].tid * scratch_area_size();
+		contexts[i].free_slots = malloc(win_size * sizeof(int));
+		if (contexts[i].free_slots == NULL)
+			perror("malloc");
+		for (int j = 0; j < win_size; j++)
+			contexts[i].free_slots[j] = j;
+		contexts[i].num_free = win_size;
+		contexts[i].res = rs;
+		contexts[i].inv_ns = inv_times ? inv_times + (r - requests) : NULL;
+		contexts[i].resp_ns = resp_times ? resp_times + (r - requests) : NULL;
+		contexts[i].arrival_ns = arrival_times ? arrival_times + (r - requests) : NULL;
 
 		if (pthread_create(&threads[i], NULL, &thread_function, &contexts[i]))
 			perror("pthread_create");
@@ -365,7 +746,7 @@ void wait_for_threads() {
 }
 
 void usage(char *name) {
-	printf("Usage: %s [-h] [-n num_threads] [-w win_size] [-v] [-t kv_store_threads] [-s init_table_size] [-f]\n", name);
+	printf("Usage: %s [-h] [-n num_threads] [-w win_size] [-v] [-t kv_store_threads] [-s init_table_size] [-f] [-m] [-a server_args] [-r] [-k kill_after_ms] [-H history_file] [-T trace_every] [-q] [-P capture_file] [-S speed]\n", name);
 	printf("-h show this help\n");
 	printf("-n specify the number of threads\n");
 	printf("-w specify the window size (max distance between last submitted request and last completed request\n");
@@ -376,6 +757,15 @@ void usage(char *name) {
 	printf("-c if set, checks the result of get queries - only works if -n 1 and -w 1 (synchronus submission)\n");
 	printf("-l input workload file name (default: workload.txt)\n");
 	printf("-e file name that contains the expected results for get queries(default: solution.txt)\n");
+	printf("-a extra arguments for the kv_store program, e.g. \"-c 1000 -e 500\" (ignored if -f is not set)\n");
+	printf("-m use an anonymous (memfd) huge page region instead of shmem_file - requires -f\n");
+	printf("-r also fork a hot standby server that replays the primary's puts and takes over if it dies - requires -f\n");
+	printf("-H write every request with its submit/completion times and result to this file, for lin_check - works with any -n and -w\n");
+	printf("-T trace one in this many requests through the ring and the server, and print per-stage latency histograms\n");
+	printf("-q collect completions from a per-thread completion queue, in any order, instead of polling the status board in order\n");
+	printf("-P replay a capture written by the server's -C option instead of a workload file, spread over all threads\n");
+	printf("-S replay speed for -P: 1 keeps the captured timing, 2 is twice as fast, 0 submits as fast as the window allows (default: 1)\n");
+	printf("-k kill the primary server with SIGKILL after this many ms to test failover - requires -r\n");
 }
 
 static int parse_args(int argc, char **argv)
@@ -385,7 +775,7 @@ static int parse_args(int argc, char **argv)
 	strcpy(expected_file, "solution.txt");
 
 	int op;
-	while ((op = getopt(argc, argv, "hn:w:vt:s:fce:i:")) != -1) {
+	while ((op = getopt(argc, argv, "hn:w:vt:s:fce:i:ma:rk:H:T:qP:S:")) != -1) {
 		switch (op) {
 		case 'h':
 		usage(argv[0]);
@@ -419,13 +809,53 @@ static int parse_args(int argc, char **argv)
 		case 'c':
 		validate = 1;
 		break;
+
+		case 'm':
+		use_memfd = 1;
+		break;
+
+		case 'a':
+		strncpy(s_extra_args, optarg, LINE_LEN - 1);
+		break;
+
+		case 'r':
+		replicate = 1;
+		break;
+
+		case 'k':
+		kill_after_ms = atoi(optarg);
+		break;
+
+		case 'H':
+		strncpy(history_file, optarg, sizeof(history_file) - 1);
+		break;
+
+		case 'T':
+		trace_every = atoi(optarg);
+		break;
+
+		case 'q':
+		use_cq = 1;
+		break;
+
+		case 'P':
+		strncpy(replay_file, optarg, sizeof(replay_file) - 1);
+		break;
+
+		case 'S':
+		replay_speed = atof(optarg);
+		if (replay_speed < 0) {
+			usage(argv[0]);
+			return 1;
+		}
+		break;
 	
 		case 'i':
 		strcpy(workload_file, optarg);
 		break;
 
 		case 'e':
-		strncpy(expected_file, optarg, 256);
+		strncpy(expected_file, optarg, sizeof(expected_file) - 1);
 		break;
 		
 		default:
@@ -490,13 +920,134 @@ int check_results(value_type *expected) {
 	return 0;
 }
 
+/*
+ * Write the history recorded with -H, one completed request per line:
+ * "put key value inv_ns resp_ns", "get key result inv_ns resp_ns" or, for
+ * INCR/CAS/GETSET, "rmw key old new inv_ns resp_ns" with the values returned
+ * An mget/mput is written as a get/put per key, all with its times
+ * Requests left over by the even split between threads were never submitted
+ * @return 0 on success, 1 otherwise
+*/
+int write_history() {
+	FILE *f = fopen(history_file, "w");
+	if (f == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	int reqs_per_th = num_requests / num_threads;
+	for (int i = 0; i < reqs_per_th * num_threads; i++) {
+		for (uint32_t j = 0; j < requests[i].nkeys; j++)
+			fprintf(f, "%s %u %u %lu %lu\n", requests[i].t == MPUT ? PUT_STR : GET_STR, requests[i].pairs[j].k,
+					requests[i].pairs[j].v, inv_times[i], resp_times[i]);
+		if (requests[i].nkeys)
+			continue;
+		if (requests[i].t == PUT || requests[i].t == GET)
+			fprintf(f, "%s %u %u %lu %lu\n", requests[i].t == PUT ? PUT_STR : GET_STR, requests[i].k,
+					requests[i].t == PUT ? requests[i].v : results[i].v, inv_times[i], resp_times[i]);
+		else
+			fprintf(f, "rmw %u %u %u %lu %lu\n", requests[i].k, results[i].old, results[i].v,
+					inv_times[i], resp_times[i]);
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Upper bound of the bucket holding the q-quantile of a histogram
+*/
+uint64_t hist_quantile(uint64_t *hist, uint64_t n, double q) {
+	uint64_t seen = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen > 0 && seen >= q * n)
+			return 1ULL << b;
+	}
+	return 1ULL << (HIST_BUCKETS - 1);
+}
+
+/*
+ * Sum the stage histograms of all threads and print them - percentiles are
+ * bucket upper bounds, so they're accurate to a factor of 2
+*/
+void print_trace() {
+	const char *names[NUM_STAGES] = { "queue", "service", "completion", "total" };
+	uint64_t hist[NUM_STAGES][HIST_BUCKETS] = {{0}};
+	for (int i = 0; i < num_threads; i++)
+		for (int st = 0; st < NUM_STAGES; st++)
+			for (int b = 0; b < HIST_BUCKETS; b++)
+				hist[st][b] += contexts[i].hist[st][b];
+
+	uint64_t n = 0;
+	for (int b = 0; b < HIST_BUCKETS; b++)
+		n += hist[STAGE_TOTAL][b];
+	printf("Trace: %lu sampled requests (1 in %d)\n", n, trace_every);
+	if (n == 0)
+		return;
+	for (int st = 0; st < NUM_STAGES; st++)
+		printf("Trace %-10s p50 < %lu ns, p99 < %lu ns, p99.9 < %lu ns\n", names[st],
+				hist_quantile(hist[st], n, 0.5), hist_quantile(hist[st], n, 0.99),
+				hist_quantile(hist[st], n, 0.999));
+
+	printf("%14s", "< ns");
+	for (int st = 0; st < NUM_STAGES; st++)
+		printf(" %10s", names[st]);
+	printf("\n");
+	for (int b = 0; b < HIST_BUCKETS; b++) {
+		if (!hist[STAGE_QUEUE][b] && !hist[STAGE_SERVICE][b] &&
+				!hist[STAGE_COMPLETION][b] && !hist[STAGE_TOTAL][b])
+			continue;
+		printf("%14lu", 1UL << b);
+		for (int st = 0; st < NUM_STAGES; st++)
+			printf(" %10lu", hist[st][b]);
+		printf("\n");
+	}
+}
+
+/*
+ * Add up the page faults of the forked servers so far from /proc/<pid>/stat
+ * A primary killed with -k still has its counters there until it is reaped
+ * @param ru only ru_minflt and ru_majflt are filled
+ * @return the number of servers whose counters could be read
+*/
+int server_faults(struct rusage *ru) {
+	int pids[] = {child_pid, standby_pid};
+	int found = 0;
+	memset(ru, 0, sizeof(*ru));
+	for (int i = 0; i < 2; i++) {
+		char path[64], buf[512];
+		long minflt, majflt;
+		if (pids[i] <= 0)
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/stat", pids[i]);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+		fclose(f);
+		buf[n] = '\0';
+		/* The command name may hold spaces and parentheses, skip past it */
+		char *p = strrchr(buf, ')');
+		if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %ld %*u %ld", &minflt, &majflt) != 2)
+			continue;
+		ru->ru_minflt += minflt;
+		ru->ru_majflt += majflt;
+		found++;
+	}
+	return found;
+}
+
 /*
  * Check the correctness of the results and print performance numbers
  * @param s start timestamp
  * @param e end timestamp
+ * @param rs resource usage at the start timestamp
+ * @param re resource usage at the end timestamp
+ * @param ss server page faults at the start timestamp, NULL without a forked server
+ * @param se server page faults at the end timestamp
  * @return 0 on success, 1 if the check fails
 */
-int process_results(struct timespec *s, struct timespec *e) {
+int process_results(struct timespec *s, struct timespec *e, struct rusage *rs, struct rusage *re,
+		struct rusage *ss, struct rusage *se) {
 	if (validate) {
 		value_type *expected = NULL;
 		FILE *f = fopen(expected_file, "r");
@@ -513,11 +1064,22 @@ int process_results(struct timespec *s, struct timespec *e) {
 		if (check_results(expected) != 0)
 			return 1;
 	}
+	if (history_file[0] && write_history() != 0)
+		return 1;
 
 	double ns = get_elapsed_ns(s, e);
 	/* Throughput in K requests per second */
 	double tput = (num_requests * 1e6) / ns;
 	printf("Total time: %f ms\nThroughput: %f K/s\n", ns / 1e6, tput);
+	if (num_keys != num_requests)
+		printf("Key throughput: %f K/s\n", num_keys * 1e6 / ns);
+	printf("Page faults: %ld minor, %ld major\n", re->ru_minflt - rs->ru_minflt,
+			re->ru_majflt - rs->ru_majflt);
+	if (ss != NULL)
+		printf("Server page faults: %ld minor, %ld major\n", se->ru_minflt - ss->ru_minflt,
+				se->ru_majflt - ss->ru_majflt);
+	if (trace_every)
+		print_trace();
 
 	/* No errors in check results */
 	return 0;
@@ -527,21 +1089,44 @@ int main(int argc, char *argv[]) {
 	if (parse_args(argc, argv) != 0)
 		exit(EXIT_FAILURE);
 
-	init_client();
+	/* The workload first - mget/mput lines decide the size of the shared region */
+	if (replay_file[0])
+		read_capture_file();
+	else
+		read_input_files();
 
-	read_input_files();
+	init_client();
 
 	struct timespec s, e;
+	struct rusage rs, re, ss, se;
+	getrusage(RUSAGE_SELF, &rs);
+	int servers = server_faults(&ss);
 	clock_gettime(CLOCK_REALTIME, &s);
 
+	pthread_t killer;
+	if (replicate && kill_after_ms > 0 && child_pid > 0)
+		pthread_create(&killer, NULL, killer_function, NULL);
+
+	replay_start_ns = now_ns();
 	start_threads();
 	wait_for_threads();
 
 	clock_gettime(CLOCK_REALTIME, &e);
+	getrusage(RUSAGE_SELF, &re);
+	/* Only compare when the same servers were counted at both ends */
+	if (server_faults(&se) != servers)
+		servers = 0;
+
+	/* Stop the server app - SIGTERM lets it exit normally (flushing profile
+	 * data in pgo builds), and waiting keeps back-to-back runs apart */
+	if (child_pid > 0) {
+		kill(child_pid, SIGTERM);
+		waitpid(child_pid, NULL, 0);
+	}
+	if (standby_pid > 0) {
+		kill(standby_pid, SIGTERM);
+		waitpid(standby_pid, NULL, 0);
+	}
 
-	/* Kill the server app */
-	if (child_pid > 0)
-		kill(child_pid, SIGKILL);
-
-	return process_results(&s, &e);
+	return process_results(&s, &e, &rs, &re, servers ? &ss : NULL, &se);
 }
@@ -1,10 +1,37 @@
 #pragma once
 #include <stdint.h> 
+#include <time.h>
 
 typedef uint32_t key_type;
 typedef uint32_t value_type;
 typedef uint32_t index_t;
 
-static index_t hash_function(key_type k, int table_size) {
+static inline index_t hash_function(key_type k, int table_size) {
 	return k % table_size;
 }
+
+/* Precomputed reciprocal of a table size so that k % size needs no division
+ * (Lemire et al., "Faster Remainder by Direct Computation") - the result is
+ * exact for every 32-bit key and size, so it's a drop-in for hash_function */
+typedef struct {
+	uint64_t m;
+	uint32_t d;
+} fastmod_t;
+
+static inline fastmod_t fastmod_init(uint32_t d) {
+	fastmod_t f = { UINT64_MAX / d + 1, d };
+	return f;
+}
+
+static inline index_t hash_function_fast(key_type k, fastmod_t f) {
+	uint64_t lowbits = f.m * k;
+	return (index_t)(((__uint128_t)lowbits * f.d) >> 64);
+}
+
+/* CLOCK_MONOTONIC in ns - the same clock in every process, so timestamps
+ * taken by the client and the server can be subtracted */
+static inline uint64_t now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
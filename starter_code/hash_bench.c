@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "common.h"
+
+/*
+ * Microbenchmark for the cost of hashing a key to its home bucket
+ * Compares hash_function (runtime % table_size) against hash_function_fast
+ * (precomputed reciprocal) for a set of table sizes, and checks that both
+ * map every key to the same bucket
+ *
+ * Usage: ./hash_bench [-k num_keys] [-r rounds] [size ...]
+*/
+
+#define DEFAULT_KEYS (1 << 20)
+#define DEFAULT_ROUNDS 20
+
+/* Keeps the compiler from dropping the hash loops */
+volatile index_t sink;
+
+double get_elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+double bench_mod(key_type *keys, int num_keys, int rounds, int size) {
+	struct timespec s, e;
+	index_t acc = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < num_keys; i++)
+			acc += hash_function(keys[i], size);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	sink = acc;
+	return get_elapsed_ns(&s, &e) / ((double)num_keys * rounds);
+}
+
+double bench_fastmod(key_type *keys, int num_keys, int rounds, int size) {
+	struct timespec s, e;
+	index_t acc = 0;
+	fastmod_t f = fastmod_init(size);
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < num_keys; i++)
+			acc += hash_function_fast(keys[i], f);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	sink = acc;
+	return get_elapsed_ns(&s, &e) / ((double)num_keys * rounds);
+}
+
+/* @return 0 if both hashes agree on every key, 1 otherwise */
+int check_equal(key_type *keys, int num_keys, int size) {
+	fastmod_t f = fastmod_init(size);
+	for (int i = 0; i < num_keys; i++) {
+		if (hash_function(keys[i], size) != hash_function_fast(keys[i], f)) {
+			fprintf(stderr, "Mismatch: key %u size %d: %u != %u\n", keys[i], size,
+					hash_function(keys[i], size), hash_function_fast(keys[i], f));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int num_keys = DEFAULT_KEYS;
+	int rounds = DEFAULT_ROUNDS;
+	int default_sizes[] = { 1, 1000, 100003, 1000000, 2147483647 };
+	int op;
+
+	while ((op = getopt(argc, argv, "k:r:")) != -1) {
+		switch (op) {
+		case 'k':
+		num_keys = atoi(optarg);
+		break;
+
+		case 'r':
+		rounds = atoi(optarg);
+		break;
+
+		default:
+		printf("Usage: %s [-k num_keys] [-r rounds] [size ...]\n", argv[0]);
+		return 1;
+		}
+	}
+
+	key_type *keys = malloc(num_keys * sizeof(key_type));
+	if (keys == NULL) {
+		perror("malloc");
+		return 1;
+	}
+	srand(537);
+	for (int i = 0; i < num_keys; i++)
+		keys[i] = ((key_type)rand() << 16) ^ (key_type)rand();
+
+	int num_sizes = argc - optind;
+	if (num_sizes == 0)
+		num_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+	printf("%-12s %12s %12s %8s\n", "size", "mod ns/op", "fast ns/op", "speedup");
+	for (int i = 0; i < num_sizes; i++) {
+		int size = optind < argc ? atoi(argv[optind + i]) : default_sizes[i];
+		if (size <= 0 || check_equal(keys, num_keys, size) != 0)
+			return 1;
+
+		double mod_ns = bench_mod(keys, num_keys, rounds, size);
+		double fast_ns = bench_fastmod(keys, num_keys, rounds, size);
+		printf("%-12d %12.3f %12.3f %7.2fx\n", size, mod_ns, fast_ns, mod_ns / fast_ns);
+	}
+
+	free(keys);
+	return 0;
+}
@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <math.h>
+
+#include "common.h"
+#include "kv_engine.h"
+#include "snapshot.h"
+#include "bench_util.h"
+
+/*
+ * KV engine benchmark - put/get straight into kv_engine.o, no ring, client
+ * or status board in the way
+ * For every combination of thread count, table size and load factor the
+ * table is rebuilt, prefilled with load_factor * table_size keys and then
+ * hit with the same request stream, split evenly between the threads.
+ * The stream is either a workload file (-i, puts insert new keys) or
+ * synthetic (-d uniform|zipf, puts update prefilled keys so the load factor
+ * stays put). Prints ops/sec and the average/stddev/max probe length of a
+ * GET for a present key after the run.
+ * -B runs the stream through process_requests in groups of that size (with
+ * the group's slots prefetched) instead of one put/get at a time.
+ * -M makes that fraction of the synthetic GETs look up absent keys, -r
+ * switches the table to Robin Hood probing.
+ * -c runs the table in cache mode with room for that fraction of its slots
+ * (through process_requests, one at a time unless -B) - with fewer slots
+ * than prefilled keys, puts keep evicting and shifting entries back.
+ * -t, -s and -l take comma separated lists.
+ * -L times filling the table instead: the prefill (or every put of the
+ * snapshot given with -f) is inserted with one put at a time, then with
+ * bulk_load on each thread count, and every key is checked afterwards.
+ * -D writes the synthetic prefill of the first size and load factor as a
+ * binary snapshot for the server's -l.
+*/
+
+#define MAX_THREADS 64
+#define MAX_LIST 16
+#define MAX_BATCH 64
+
+struct op {
+	int is_put;
+	key_type k;
+	value_type v;
+};
+
+struct thread_context {
+	struct op *ops;
+	int num_ops;
+};
+
+char workload_file[256];
+char dist[16] = "uniform";
+double zipf_theta = 0.99;
+double get_ratio = 0.9;
+double miss_ratio = 0;
+int robin_hood = 0;
+double cache_ratio = 0;
+int batch = 0;
+int num_ops = 2000000;
+int load_mode = 0;
+char snapshot_file[256];
+char dump_file[256];
+int thread_counts[MAX_LIST] = { 1 };
+int num_thread_counts = 1;
+int table_sizes[MAX_LIST] = { 1 << 20 };
+int num_table_sizes = 1;
+double load_factors[MAX_LIST] = { 0.5 };
+int num_load_factors = 1;
+struct op *ops;
+volatile value_type sink; /* keeps the gets from being optimized out */
+pthread_t threads[MAX_THREADS];
+struct thread_context contexts[MAX_THREADS];
+
+/* i-th prefilled key - an odd multiplier is a bijection, so keys are
+ * distinct, nonzero for i > 0, and scattered over the key space */
+static inline key_type nth_key(uint32_t i) {
+	return (i + 1) * 2654435761u;
+}
+
+int parse_int_list(char *s, int *out) {
+	int n = 0;
+	for (char *tok = strtok(s, ","); tok != NULL && n < MAX_LIST; tok = strtok(NULL, ","))
+		out[n++] = atoi(tok);
+	return n;
+}
+
+int parse_double_list(char *s, double *out) {
+	int n = 0;
+	for (char *tok = strtok(s, ","); tok != NULL && n < MAX_LIST; tok = strtok(NULL, ","))
+		out[n++] = atof(tok);
+	return n;
+}
+
+/* Only the puts and gets of workload_file count */
+void read_ops() {
+	struct buffer_descriptor *reqs;
+	int n = read_workload(workload_file, &reqs);
+	ops = malloc((n > 0 ? n : 1) * sizeof(struct op));
+	if (ops == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	num_ops = 0;
+	for (int i = 0; i < n; i++) {
+		if (reqs[i].req_type != PUT && reqs[i].req_type != GET)
+			continue;
+		ops[num_ops].is_put = reqs[i].req_type == PUT;
+		ops[num_ops].k = reqs[i].k;
+		ops[num_ops].v = reqs[i].v;
+		num_ops++;
+	}
+	free(reqs);
+}
+
+/*
+ * Synthetic stream over the keys prefilled for a given key count
+ * zipf draws ranks from a precomputed CDF, rank r maps to nth_key(r)
+*/
+void make_stream(int keys) {
+	unsigned int seed = 537;
+	double *cdf = NULL;
+	if (!strcmp(dist, "zipf")) {
+		cdf = malloc(keys * sizeof(double));
+		double sum = 0;
+		for (int r = 0; r < keys; r++)
+			cdf[r] = sum += 1.0 / pow(r + 1, zipf_theta);
+		for (int r = 0; r < keys; r++)
+			cdf[r] /= sum;
+	}
+
+	for (int i = 0; i < num_ops; i++) {
+		uint32_t rank;
+		if (cdf != NULL) {
+			double u = (double)rand_r(&seed) / RAND_MAX;
+			int lo = 0, hi = keys - 1;
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (cdf[mid] < u)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			rank = lo;
+		} else {
+			rank = rand_r(&seed) % keys;
+		}
+		ops[i].is_put = (double)rand_r(&seed) / RAND_MAX >= get_ratio;
+		/* Keys past the prefilled ones are never inserted */
+		if (!ops[i].is_put && (double)rand_r(&seed) / RAND_MAX < miss_ratio)
+			rank += keys;
+		ops[i].k = nth_key(rank);
+		ops[i].v = i + 1;
+	}
+	free(cdf);
+}
+
+void *thread_function(void *arg) {
+	struct thread_context *ctx = arg;
+	value_type sum = 0;
+	for (int i = 0; i < ctx->num_ops; i++) {
+		if (ctx->ops[i].is_put)
+			put(ctx->ops[i].k, ctx->ops[i].v);
+		else
+			sum += get(ctx->ops[i].k);
+	}
+	sink = sum;
+	return NULL;
+}
+
+/* Same stream, handed to the engine batch requests at a time */
+void *batch_function(void *arg) {
+	struct thread_context *ctx = arg;
+	struct buffer_descriptor bds[MAX_BATCH];
+	value_type sum = 0;
+	for (int i = 0; i < ctx->num_ops; i += batch) {
+		int n = ctx->num_ops - i < batch ? ctx->num_ops - i : batch;
+		memset(bds, 0, n * sizeof(struct buffer_descriptor));
+		for (int j = 0; j < n; j++) {
+			bds[j].req_type = ctx->ops[i + j].is_put ? PUT : GET;
+			bds[j].k = ctx->ops[i + j].k;
+			bds[j].v = ctx->ops[i + j].v;
+		}
+		process_requests(bds, n);
+		for (int j = 0; j < n; j++)
+			sum += bds[j].v;
+	}
+	sink = sum;
+	return NULL;
+}
+
+/*
+ * Rebuild the table and run the stream once
+ * @return ops/sec
+*/
+double run(int nthreads, int table_size, double load_factor) {
+	set_probing(robin_hood ? PROBE_ROBIN_HOOD : PROBE_LINEAR);
+	initialize_hashTable(table_size);
+	int keys = load_factor * table_size;
+	if (cache_ratio > 0) {
+		struct buffer_descriptor bd;
+		initialize_cache(cache_ratio * table_size, 0);
+		for (int i = 0; i < keys; i++) {
+			memset(&bd, 0, sizeof(bd));
+			bd.req_type = PUT;
+			bd.k = nth_key(i);
+			bd.v = i + 1;
+			process_request(&bd);
+		}
+	} else {
+		for (int i = 0; i < keys; i++)
+			put(nth_key(i), i + 1);
+	}
+	if (workload_file[0] == '\0')
+		make_stream(keys > 0 ? keys : 1);
+
+	int per_thread = num_ops / nthreads;
+	double start = now_us();
+	for (int i = 0; i < nthreads; i++) {
+		contexts[i].ops = ops + i * per_thread;
+		contexts[i].num_ops = per_thread;
+		if (pthread_create(&threads[i], NULL, batch ? batch_function : thread_function, &contexts[i]))
+			perror("pthread_create");
+	}
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	return per_thread * nthreads * 1e6 / (now_us() - start);
+}
+
+/*
+ * Pairs to fill the table with - the snapshot file, or the prefill of run
+ * @return the number of pairs in *pairs (malloc'ed)
+*/
+size_t make_pairs(struct kv_pair **pairs, int table_size, double load_factor) {
+	size_t n;
+	if (snapshot_file[0]) {
+		if (snapshot_read(snapshot_file, pairs, &n) < 0)
+			exit(EXIT_FAILURE);
+		return n;
+	}
+	n = load_factor * table_size;
+	*pairs = malloc((n > 0 ? n : 1) * sizeof(struct kv_pair));
+	if (*pairs == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < n; i++) {
+		(*pairs)[i].k = nth_key(i);
+		(*pairs)[i].v = i + 1;
+	}
+	return n;
+}
+
+struct indexed_pair {
+	struct kv_pair p;
+	size_t i;
+};
+
+int cmp_indexed_pair(const void *a, const void *b) {
+	const struct indexed_pair *x = a, *y = b;
+	if (x->p.k != y->p.k)
+		return (x->p.k > y->p.k) - (x->p.k < y->p.k);
+	return (x->i > y->i) - (x->i < y->i);
+}
+
+/*
+ * Fill a new table with pairs, one put at a time (nthreads 0) or with
+ * bulk_load, then check that every key reads back its last value
+ * @return elapsed ms of the fill
+*/
+double load_run(struct kv_pair *pairs, size_t n, int nthreads, int table_size) {
+	set_probing(robin_hood ? PROBE_ROBIN_HOOD : PROBE_LINEAR);
+	initialize_hashTable(table_size);
+	double start = now_us();
+	if (nthreads == 0) {
+		for (size_t i = 0; i < n; i++)
+			put(pairs[i].k, pairs[i].v);
+	} else if (bulk_load(pairs, n, nthreads) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	double elapsed = (now_us() - start) / 1e3;
+
+	/* A repeated key has to read back its last value - sorted by key and
+	 * then position, that's the last pair of each run */
+	struct indexed_pair *sorted = malloc((n > 0 ? n : 1) * sizeof(struct indexed_pair));
+	if (sorted == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < n; i++) {
+		sorted[i].p = pairs[i];
+		sorted[i].i = i;
+	}
+	qsort(sorted, n, sizeof(struct indexed_pair), cmp_indexed_pair);
+	size_t wrong = 0;
+	for (size_t i = 0; i < n; i++)
+		if ((i + 1 == n || sorted[i + 1].p.k != sorted[i].p.k) && get(sorted[i].p.k) != sorted[i].p.v)
+			wrong++;
+	free(sorted);
+	if (wrong) {
+		printf("%zu keys read back wrong after loading with %d threads\n", wrong, nthreads);
+		exit(EXIT_FAILURE);
+	}
+	return elapsed;
+}
+
+/*
+ * -L: fill times for every size and load factor, serial puts vs bulk_load
+*/
+void load_bench() {
+	printf("Fill: %s, %s probing\n", snapshot_file[0] ? snapshot_file : "prefill keys",
+			robin_hood ? "robin hood" : "linear");
+	printf("%8s %10s %6s %10s %10s %12s %10s\n", "threads", "size", "load", "keys", "ms", "M keys/s",
+			"max probe");
+	for (int s = 0; s < num_table_sizes; s++) {
+		for (int l = 0; l < num_load_factors; l++) {
+			struct kv_pair *pairs;
+			size_t n = make_pairs(&pairs, table_sizes[s], load_factors[l]);
+			for (int t = -1; t < num_thread_counts; t++) {
+				int nthreads = t < 0 ? 0 : thread_counts[t];
+				double ms = load_run(pairs, n, nthreads, table_sizes[s]);
+				double avg_probes, stddev_probes;
+				int max_probes;
+				probe_stats(&avg_probes, &stddev_probes, &max_probes);
+				char label[16];
+				snprintf(label, sizeof(label), nthreads ? "%d" : "put", nthreads);
+				printf("%8s %10d %6.2f %10zu %10.1f %12.2f %10d\n", label, table_sizes[s], load_factors[l],
+						n, ms, n / ms / 1e3, max_probes);
+			}
+			free(pairs);
+		}
+	}
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-i workload | -d uniform|zipf] [-z zipf_theta] [-g get_ratio] [-M miss_ratio] [-r | -c cache_ratio] [-B batch] [-o ops] "
+			"[-t threads,...] [-s table_size,...] [-l load_factor,...] [-L [-f snapshot]] [-D snapshot]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hi:d:z:g:M:rc:B:o:t:s:l:Lf:D:")) != -1) {
+		switch (op) {
+		case 'i':
+		strncpy(workload_file, optarg, sizeof(workload_file) - 1);
+		break;
+
+		case 'd':
+		strncpy(dist, optarg, sizeof(dist) - 1);
+		break;
+
+		case 'z':
+		zipf_theta = atof(optarg);
+		break;
+
+		case 'g':
+		get_ratio = atof(optarg);
+		break;
+
+		case 'M':
+		miss_ratio = atof(optarg);
+		break;
+
+		case 'r':
+		robin_hood = 1;
+		break;
+
+		case 'c':
+		cache_ratio = atof(optarg);
+		break;
+
+		case 'B':
+		batch = atoi(optarg);
+		break;
+
+		case 'o':
+		num_ops = atoi(optarg);
+		break;
+
+		case 't':
+		num_thread_counts = parse_int_list(optarg, thread_counts);
+		break;
+
+		case 's':
+		num_table_sizes = parse_int_list(optarg, table_sizes);
+		break;
+
+		case 'l':
+		num_load_factors = parse_double_list(optarg, load_factors);
+		break;
+
+		case 'L':
+		load_mode = 1;
+		break;
+
+		case 'f':
+		strncpy(snapshot_file, optarg, sizeof(snapshot_file) - 1);
+		break;
+
+		case 'D':
+		strncpy(dump_file, optarg, sizeof(dump_file) - 1);
+		break;
+
+		default:
+		usage(argv[0]);
+		exit(op == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if ((strcmp(dist, "uniform") && strcmp(dist, "zipf")) || num_ops <= 0 || batch < 0 || batch > MAX_BATCH ||
+			cache_ratio < 0 || cache_ratio >= 1 || (cache_ratio > 0 && robin_hood)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < num_thread_counts; i++)
+		if (thread_counts[i] <= 0 || thread_counts[i] > MAX_THREADS) {
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	for (int i = 0; i < num_load_factors; i++)
+		if (load_factors[i] < 0 || load_factors[i] >= 1) {
+			printf("Load factors must be in [0, 1)\n");
+			exit(EXIT_FAILURE);
+		}
+
+	if (dump_file[0]) {
+		struct kv_pair *pairs;
+		size_t n = make_pairs(&pairs, table_sizes[0], load_factors[0]);
+		if (snapshot_write(dump_file, pairs, n) < 0)
+			exit(EXIT_FAILURE);
+		printf("Wrote %zu pairs to %s\n", n, dump_file);
+		return 0;
+	}
+	if (load_mode) {
+		load_bench();
+		return 0;
+	}
+
+	if (workload_file[0])
+		read_ops();
+	else
+		ops = malloc(num_ops * sizeof(struct op));
+
+	/* The cache is only reachable through process_request */
+	if (cache_ratio > 0 && batch == 0)
+		batch = 1;
+	char mode[32] = "";
+	if (cache_ratio > 0)
+		snprintf(mode, sizeof(mode), ", cache of %.0f%% of the slots", cache_ratio * 100);
+	printf("Stream: %s, %d ops, %s probing%s, %s\n", workload_file[0] ? workload_file : dist, num_ops,
+			robin_hood ? "robin hood" : "linear", mode, batch > 1 ? "prefetched groups" : "one at a time");
+	printf("%8s %10s %6s %12s %10s %10s %10s %10s\n", "threads", "size", "load", "M ops/s", "ns/op",
+			"avg probe", "stddev", "max probe");
+	for (int s = 0; s < num_table_sizes; s++) {
+		for (int l = 0; l < num_load_factors; l++) {
+			for (int t = 0; t < num_thread_counts; t++) {
+				double tput = run(thread_counts[t], table_sizes[s], load_factors[l]);
+				double avg_probes, stddev_probes;
+				int max_probes;
+				probe_stats(&avg_probes, &stddev_probes, &max_probes);
+				printf("%8d %10d %6.2f %12.2f %10.1f %10.2f %10.2f %10d\n", thread_counts[t], table_sizes[s],
+						load_factors[l], tput / 1e6, 1e9 / tput, avg_probes, stddev_probes, max_probes);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,875 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "common.h"
+#include "kv_engine.h"
+#include "replication.h"
+
+/* is_occupied values - SLOT_DELETED only marks the slot of a cache mode entry
+ * while cache_remove shifts the entries after it back, under its lock, so a
+ * walk never sees one */
+#define SLOT_EMPTY 0
+#define SLOT_USED 1
+#define SLOT_DELETED 2
+
+typedef struct
+{
+    key_type key;
+    value_type value;
+    int is_occupied;
+    uint32_t expires; /* cache mode: ms since cache.epoch, 0 = never */
+    uint8_t ref;      /* cache mode: CLOCK reference bit */
+    uint32_t dist;    /* Robin Hood: distance from the key's home slot */
+    pthread_mutex_t lock;
+} HashEntry;
+
+typedef struct
+{
+    HashEntry *entries;
+    int size;
+    fastmod_t mod; /* reciprocal of size, recomputed whenever size changes */
+    enum PROBING probing;
+    int used; /* Robin Hood: occupied slots, reserved before an insert */
+} HashTable;
+
+HashTable hashTable;
+
+/* Bounded cache mode (-c capacity) - at most capacity live entries, entries
+ * expire ttl ms after their PUT (checked lazily on access), and a CLOCK hand
+ * shared by all threads evicts one entry per insert over capacity */
+
+typedef struct CacheStats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t expirations;
+    uint64_t shifted; /* entries cache_remove moved back */
+    struct CacheStats *next;
+} CacheStats;
+
+struct
+{
+    int enabled;
+    int capacity;
+    uint32_t default_ttl_ms;
+    int live;      /* live entries */
+    uint64_t hand; /* CLOCK hand, taken modulo the table size */
+    struct timespec epoch;
+    CacheStats *stats; /* per-thread counters, summed when printed */
+    pthread_mutex_t stats_lock;
+} cache;
+
+static __thread CacheStats *my_cache_stats;
+
+void initialize_hashTable(int size)
+{
+    free(hashTable.entries);
+    hashTable.size = size;
+    hashTable.mod = fastmod_init(size);
+    hashTable.used = 0;
+    hashTable.entries = malloc(size * sizeof(HashEntry));
+
+    for (int i = 0; i < size; i++)
+    {
+        hashTable.entries[i].is_occupied = 0;
+        hashTable.entries[i].dist = 0;
+        pthread_mutex_init(&hashTable.entries[i].lock, NULL);
+    }
+}
+
+void set_probing(enum PROBING probing)
+{
+    hashTable.probing = probing;
+}
+
+/*
+ * Compute what a write request leaves in an entry
+ * @param cur current value, 0 for a missing key
+ * @param expected CAS only
+ * @param next set to the value to store
+ * @return 1 if next has to be stored, 0 if the entry stays as is (failed CAS)
+ */
+static inline int apply_write(enum REQUEST_TYPE op, value_type cur, value_type v, value_type expected,
+                              value_type *next)
+{
+    switch (op)
+    {
+    case INCR:
+        *next = cur + v;
+        return 1;
+    case CAS:
+        *next = cur == expected ? v : cur;
+        return cur == expected;
+    default: /* PUT, GETSET */
+        *next = v;
+        return 1;
+    }
+}
+
+/*
+ * Robin Hood probing - every entry records its distance from its home slot
+ * and an insert takes the slot of any entry closer to home than itself,
+ * carrying that entry on. Chains stay sorted by distance, so a lookup can
+ * stop at the first entry closer to home than it has probed (a miss) instead
+ * of running to the end of the cluster.
+ * Entries move forward while carried, so readers and writers walk a chain
+ * lock coupled (see chain_next) and never overtake each other - a reader
+ * can't miss an entry in flight.
+ * Plain mode only, cache mode stays linear.
+ */
+
+/* Step a lock coupled walk to the next slot - it is locked before the
+ * current one is released */
+static inline HashEntry *chain_next(int *index, HashEntry *e)
+{
+    if (++(*index) == hashTable.size)
+        *index = 0;
+    HashEntry *n = &hashTable.entries[*index];
+    pthread_mutex_lock(&n->lock);
+    pthread_mutex_unlock(&e->lock);
+    return n;
+}
+
+static value_type rh_get(key_type k)
+{
+    int index = hash_function_fast(k, hashTable.mod);
+    HashEntry *e = &hashTable.entries[index];
+    value_type v = 0;
+
+    pthread_mutex_lock(&e->lock);
+    for (uint32_t d = 0; d < (uint32_t)hashTable.size; d++)
+    {
+        if (!e->is_occupied || e->dist < d)
+            break;
+        if (e->key == k)
+        {
+            v = e->value;
+            break;
+        }
+        e = chain_next(&index, e);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return v;
+}
+
+static value_type rh_update(key_type k, enum REQUEST_TYPE op, value_type v, value_type *old,
+                            const struct buffer_descriptor *req)
+{
+    int index = hash_function_fast(k, hashTable.mod);
+    HashEntry *e = &hashTable.entries[index];
+    value_type expected = *old, cur = 0, next = 0;
+    uint32_t d = 0;
+    uint64_t pos = REPL_NONE;
+
+    pthread_mutex_lock(&e->lock);
+    for (; d < (uint32_t)hashTable.size; d++)
+    {
+        if (e->is_occupied && e->key == k)
+        {
+            cur = e->value;
+            if (apply_write(op, cur, v, expected, &next))
+            {
+                e->value = next;
+                pos = repl_reserve();
+            }
+            pthread_mutex_unlock(&e->lock);
+            repl_publish(pos, k, next, cur, 0, req);
+            *old = cur;
+            return next;
+        }
+        if (!e->is_occupied || e->dist < d)
+            break;
+        e = chain_next(&index, e);
+    }
+
+    /* k is missing - insert it from here unless the op declines (failed CAS)
+     * or the table is full */
+    *old = 0;
+    if (d == (uint32_t)hashTable.size || !apply_write(op, 0, v, expected, &next))
+    {
+        pthread_mutex_unlock(&e->lock);
+        return 0;
+    }
+    if (__atomic_fetch_add(&hashTable.used, 1, __ATOMIC_RELAXED) >= hashTable.size)
+    {
+        __atomic_fetch_sub(&hashTable.used, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&e->lock);
+        return 0;
+    }
+    pos = repl_reserve();
+
+    /* Place the entry and carry whatever it displaces until a free slot */
+    key_type ck = k;
+    value_type cv = next;
+    while (e->is_occupied)
+    {
+        if (e->dist < d)
+        {
+            key_type tk = e->key;
+            value_type tv = e->value;
+            uint32_t td = e->dist;
+            e->key = ck;
+            e->value = cv;
+            e->dist = d;
+            ck = tk;
+            cv = tv;
+            d = td;
+        }
+        e = chain_next(&index, e);
+        d++;
+    }
+    e->key = ck;
+    e->value = cv;
+    e->dist = d;
+    e->is_occupied = SLOT_USED;
+    pthread_mutex_unlock(&e->lock);
+    repl_publish(pos, k, next, 0, 0, req);
+    return next;
+}
+
+/*
+ * Apply a write request (PUT or a read-modify-write) under the entry lock
+ * @param old in: the expected value (CAS), out: the value before the op
+ * @param req the request it belongs to, which tags the replicated write
+ * (NULL if none)
+ * @return the value after the op
+ */
+static inline value_type update(key_type k, enum REQUEST_TYPE op, value_type v, value_type *old,
+                                const struct buffer_descriptor *req)
+{
+    if (hashTable.probing == PROBE_ROBIN_HOOD)
+        return rh_update(k, op, v, old, req);
+
+    int index = hash_function_fast(k, hashTable.mod);
+    int start = index;
+    value_type cur = 0, next = 0;
+    uint64_t pos = REPL_NONE;
+
+    do
+    {
+        HashEntry *e = &hashTable.entries[index];
+        pthread_mutex_lock(&e->lock);
+        if (!e->is_occupied || e->key == k)
+        {
+            cur = e->is_occupied ? e->value : 0;
+            if (apply_write(op, cur, v, *old, &next))
+            {
+                e->key = k;
+                e->value = next;
+                e->is_occupied = 1;
+                pos = repl_reserve();
+            }
+            pthread_mutex_unlock(&e->lock);
+            break;
+        }
+        pthread_mutex_unlock(&e->lock);
+        if (++index == hashTable.size)
+            index = 0;
+    } while (index != start);
+
+    repl_publish(pos, k, next, cur, 0, req);
+    *old = cur;
+    return next;
+}
+
+void put(key_type k, value_type v)
+{
+    value_type old = 0;
+    update(k, PUT, v, &old, NULL);
+}
+
+value_type get(key_type k)
+{
+    if (hashTable.probing == PROBE_ROBIN_HOOD)
+        return rh_get(k);
+
+    int index = hash_function_fast(k, hashTable.mod);
+    int start = index;
+    value_type v = 0;
+
+    do
+    {
+        pthread_mutex_lock(&hashTable.entries[index].lock);
+        if (hashTable.entries[index].is_occupied && hashTable.entries[index].key == k)
+        {
+            v = hashTable.entries[index].value;
+            pthread_mutex_unlock(&hashTable.entries[index].lock);
+            break;
+        }
+        pthread_mutex_unlock(&hashTable.entries[index].lock);
+        if (++index == hashTable.size)
+            index = 0;
+    } while (index != start && hashTable.entries[index].is_occupied);
+
+    return v;
+}
+
+static CacheStats *cache_stats(void)
+{
+    if (my_cache_stats == NULL)
+    {
+        my_cache_stats = calloc(1, sizeof(CacheStats));
+        pthread_mutex_lock(&cache.stats_lock);
+        my_cache_stats->next = cache.stats;
+        cache.stats = my_cache_stats;
+        pthread_mutex_unlock(&cache.stats_lock);
+    }
+    return my_cache_stats;
+}
+
+static uint32_t cache_now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+    return (t.tv_sec - cache.epoch.tv_sec) * 1000 + (t.tv_nsec - cache.epoch.tv_nsec) / 1000000;
+}
+
+static int cache_expired(HashEntry *e, uint32_t now)
+{
+    return e->expires != 0 && (int32_t)(now - e->expires) >= 0;
+}
+
+/*
+ * Remove the live entry at index - the caller holds its lock, and it is
+ * released. Backward shift deletion: each later entry of the cluster whose
+ * chain runs through the freed slot moves back into it, so no tombstone is
+ * left behind. The freed slot stays locked until it is refilled or the
+ * cluster ends, and cache walks are lock coupled, so no walk gets past it or
+ * past an entry on the move.
+ */
+static void cache_remove(int index)
+{
+    HashEntry *hole = &hashTable.entries[index];
+    HashEntry *e = hole;
+    int hole_index = index;
+    uint64_t shifted = 0;
+
+    hole->is_occupied = SLOT_DELETED;
+    __atomic_fetch_sub(&cache.live, 1, __ATOMIC_RELAXED);
+    for (int d = 1; d < hashTable.size; d++)
+    {
+        if (++index == hashTable.size)
+            index = 0;
+        HashEntry *n = &hashTable.entries[index];
+        pthread_mutex_lock(&n->lock);
+        if (e != hole)
+            pthread_mutex_unlock(&e->lock);
+        e = n;
+        if (e->is_occupied != SLOT_USED)
+            break;
+
+        /* An entry at least as far from its home as from the hole has its
+         * chain run through the hole */
+        int home = hash_function_fast(e->key, hashTable.mod);
+        if ((index - home + hashTable.size) % hashTable.size <
+            (index - hole_index + hashTable.size) % hashTable.size)
+            continue;
+        hole->key = e->key;
+        hole->value = e->value;
+        hole->expires = e->expires;
+        hole->ref = e->ref;
+        hole->is_occupied = SLOT_USED;
+        e->is_occupied = SLOT_DELETED;
+        pthread_mutex_unlock(&hole->lock);
+        hole = e;
+        hole_index = index;
+        shifted++;
+    }
+    hole->is_occupied = SLOT_EMPTY;
+    if (e != hole)
+        pthread_mutex_unlock(&e->lock);
+    pthread_mutex_unlock(&hole->lock);
+    if (shifted)
+        cache_stats()->shifted += shifted;
+}
+
+void initialize_cache(int capacity, uint32_t default_ttl_ms)
+{
+    cache.enabled = 1;
+    cache.capacity = capacity;
+    cache.default_ttl_ms = default_ttl_ms;
+    cache.live = 0;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &cache.epoch);
+    pthread_mutex_init(&cache.stats_lock, NULL);
+}
+
+/*
+ * Advance the CLOCK hand until one entry is evicted: expired entries and
+ * entries whose reference bit is clear go, referenced ones get a second
+ * chance. Bounded to two sweeps of the table.
+ */
+static void cache_evict(void)
+{
+    uint32_t now = cache_now_ms();
+
+    for (int steps = 0; steps < 2 * hashTable.size; steps++)
+    {
+        int index = __atomic_fetch_add(&cache.hand, 1, __ATOMIC_RELAXED) % hashTable.size;
+        HashEntry *e = &hashTable.entries[index];
+        if (__atomic_load_n(&e->is_occupied, __ATOMIC_RELAXED) != SLOT_USED)
+            continue;
+
+        pthread_mutex_lock(&e->lock);
+        if (e->is_occupied == SLOT_USED)
+        {
+            int expired = cache_expired(e, now);
+            if (e->ref && !expired)
+            {
+                e->ref = 0;
+            }
+            else
+            {
+                if (expired)
+                    cache_stats()->expirations++;
+                else
+                    cache_stats()->evictions++;
+                cache_remove(index);
+                return;
+            }
+        }
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+/*
+ * Cache mode write (PUT or a read-modify-write) - inserts or updates k, then
+ * evicts if over capacity. An expired entry counts as missing.
+ * The walk is lock coupled and a missing k goes into the free slot ending its
+ * chain, which the walk holds - a concurrent insert of k can't get past it
+ * @param old in: the expected value (CAS), out: the value before the op
+ * @param ttl_ms lifetime of the entry, 0 for the server's default ttl
+ * @param req the request it belongs to, which tags the replicated write
+ * @return the value after the op
+ */
+value_type cache_update(key_type k, enum REQUEST_TYPE op, value_type v, value_type *old, uint32_t ttl_ms,
+                        const struct buffer_descriptor *req)
+{
+    int index = hash_function_fast(k, hashTable.mod);
+    HashEntry *e = &hashTable.entries[index];
+    if (ttl_ms == 0)
+        ttl_ms = cache.default_ttl_ms;
+    uint32_t now = cache_now_ms();
+    uint32_t expires = ttl_ms ? (now + ttl_ms) | 1 : 0;
+    value_type expected = *old, next = 0;
+    uint64_t pos = REPL_NONE;
+
+    *old = 0;
+
+    pthread_mutex_lock(&e->lock);
+    for (int d = 0; d < hashTable.size && e->is_occupied == SLOT_USED; d++)
+    {
+        if (e->key == k)
+        {
+            *old = cache_expired(e, now) ? 0 : e->value;
+            if (apply_write(op, *old, v, expected, &next))
+            {
+                e->value = next;
+                e->expires = expires;
+                pos = repl_reserve();
+            }
+            e->ref = 1;
+            pthread_mutex_unlock(&e->lock);
+            repl_publish(pos, k, next, *old, ttl_ms, req);
+            return next;
+        }
+        e = chain_next(&index, e);
+    }
+
+    /* Unless the table is full, or a CAS expected the key to exist */
+    int inserted = 0;
+    if (e->is_occupied != SLOT_USED && apply_write(op, 0, v, expected, &next))
+    {
+        e->key = k;
+        e->value = next;
+        e->expires = expires;
+        e->ref = 0;
+        e->is_occupied = SLOT_USED;
+        inserted = 1;
+        pos = repl_reserve();
+    }
+    pthread_mutex_unlock(&e->lock);
+    repl_publish(pos, k, next, 0, ttl_ms, req);
+
+    if (inserted && __atomic_add_fetch(&cache.live, 1, __ATOMIC_RELAXED) > cache.capacity)
+        cache_evict();
+    return next;
+}
+
+/*
+ * Cache mode GET - a hit sets the entry's reference bit, an expired entry is
+ * removed and counts as a miss
+ */
+value_type cache_get(key_type k)
+{
+    int index = hash_function_fast(k, hashTable.mod);
+    HashEntry *e = &hashTable.entries[index];
+    value_type v = 0;
+    int hit = 0;
+
+    pthread_mutex_lock(&e->lock);
+    for (int d = 0; d < hashTable.size && e->is_occupied == SLOT_USED; d++)
+    {
+        if (e->key == k)
+        {
+            if (cache_expired(e, cache_now_ms()))
+            {
+                cache_stats()->expirations++;
+                cache_remove(index);
+                e = NULL;
+            }
+            else
+            {
+                v = e->value;
+                e->ref = 1;
+                hit = 1;
+            }
+            break;
+        }
+        e = chain_next(&index, e);
+    }
+    if (e != NULL)
+        pthread_mutex_unlock(&e->lock);
+
+    if (hit)
+        cache_stats()->hits++;
+    else
+        cache_stats()->misses++;
+    return v;
+}
+
+void print_cache_stats(void)
+{
+    uint64_t hits = 0, misses = 0, evictions = 0, expirations = 0, shifted = 0;
+    pthread_mutex_lock(&cache.stats_lock);
+    for (CacheStats *st = cache.stats; st != NULL; st = st->next)
+    {
+        hits += st->hits;
+        misses += st->misses;
+        evictions += st->evictions;
+        expirations += st->expirations;
+        shifted += st->shifted;
+    }
+    pthread_mutex_unlock(&cache.stats_lock);
+
+    double secs = cache_now_ms() / 1e3;
+    fprintf(stderr, "Cache: %d/%d entries, hit ratio %.4f (%lu hits, %lu misses)\n",
+            cache.live, cache.capacity, (hits + misses) ? (double)hits / (hits + misses) : 0,
+            hits, misses);
+    fprintf(stderr, "Cache: %lu evictions (%.1f/s), %lu expirations, %lu entries shifted back\n",
+            evictions, secs > 0 ? evictions / secs : 0, expirations, shifted);
+}
+
+int cache_slot_stats(int *tombstones)
+{
+    int live = 0;
+    *tombstones = 0;
+    for (int i = 0; i < hashTable.size; i++)
+    {
+        if (hashTable.entries[i].is_occupied == SLOT_USED)
+            live++;
+        else if (hashTable.entries[i].is_occupied == SLOT_DELETED)
+            (*tombstones)++;
+    }
+    return live;
+}
+
+void process_request(struct buffer_descriptor *bd)
+{
+    /* Their keys live in the batch array - see process_multi */
+    if (bd->req_type == MGET || bd->req_type == MPUT)
+        return;
+    if (cache.enabled)
+    {
+        if (bd->req_type == GET)
+            bd->v = cache_get(bd->k);
+        else
+            bd->v = cache_update(bd->k, bd->req_type, bd->v, &bd->old, bd->ttl_ms, bd);
+    }
+    else if (bd->req_type == PUT)
+    {
+        value_type old = 0;
+        update(bd->k, PUT, bd->v, &old, bd);
+    }
+    else if (bd->req_type == GET)
+    {
+        bd->v = get(bd->k);
+    }
+    else
+    {
+        bd->v = update(bd->k, bd->req_type, bd->v, &bd->old, bd);
+    }
+}
+
+void process_requests(struct buffer_descriptor *bds, int n)
+{
+    /* Group prefetching - every home slot is requested before the first one
+     * is needed, so the cache misses of the group overlap */
+    if (n > 1)
+    {
+        for (int i = 0; i < n; i++)
+            __builtin_prefetch(&hashTable.entries[hash_function_fast(bds[i].k, hashTable.mod)], 1, 3);
+    }
+    for (int i = 0; i < n; i++)
+        process_request(&bds[i]);
+}
+
+void process_multi(struct buffer_descriptor *bd, struct kv_pair *pairs)
+{
+    int n = bd->batch_len < MAX_MULTI_KEYS ? bd->batch_len : MAX_MULTI_KEYS;
+    int order[MAX_MULTI_KEYS];
+    int home[MAX_MULTI_KEYS];
+
+    /* Insertion sort by home slot - stable, so an MPUT that repeats a key
+     * still ends with its last value */
+    for (int i = 0; i < n; i++)
+    {
+        home[i] = hash_function_fast(pairs[i].k, hashTable.mod);
+        int j = i;
+        while (j > 0 && home[order[j - 1]] > home[i])
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    for (int i = 0; i < n; i++)
+        __builtin_prefetch(&hashTable.entries[home[order[i]]], 1, 3);
+
+    for (int i = 0; i < n; i++)
+    {
+        struct kv_pair *p = &pairs[order[i]];
+        value_type old = 0;
+        if (bd->req_type == MGET)
+            p->v = cache.enabled ? cache_get(p->k) : get(p->k);
+        else if (cache.enabled)
+            cache_update(p->k, PUT, p->v, &old, bd->ttl_ms, bd);
+        else
+            update(p->k, PUT, p->v, &old, bd);
+    }
+    bd->v = n;
+}
+
+/* Bulk load state - the table is split into parts ranges of home slots,
+ * one per loader thread, see bulk_load */
+static struct
+{
+    struct kv_pair *in;
+    size_t n;
+    int parts;
+    size_t *offsets;        /* [chunk * parts + range]: keys of an input chunk
+                             * headed for a range, then where they go in parted */
+    size_t *range_start;    /* [parts + 1]: slice of parted per range */
+    struct kv_pair *parted; /* the input grouped by range, in input order */
+    size_t *overflow;       /* [range]: keys left at the start of the range's
+                             * slice for the serial pass */
+    int *placed;            /* [range]: new slots filled */
+} load;
+
+/* First home slot of a range */
+static inline int range_lo(int r)
+{
+    return ((uint64_t)r * hashTable.size + load.parts - 1) / load.parts;
+}
+
+static inline int range_of(key_type k)
+{
+    return (uint64_t)hash_function_fast(k, hashTable.mod) * load.parts / hashTable.size;
+}
+
+static void *load_count(void *arg)
+{
+    int t = (int)(intptr_t)arg;
+    size_t *counts = &load.offsets[t * load.parts];
+    for (size_t i = t * load.n / load.parts; i < (t + 1) * load.n / load.parts; i++)
+        counts[range_of(load.in[i].k)]++;
+    return NULL;
+}
+
+static void *load_scatter(void *arg)
+{
+    int t = (int)(intptr_t)arg;
+    size_t *offsets = &load.offsets[t * load.parts];
+    for (size_t i = t * load.n / load.parts; i < (t + 1) * load.n / load.parts; i++)
+        load.parted[offsets[range_of(load.in[i].k)]++] = load.in[i];
+    return NULL;
+}
+
+/*
+ * Fill the slots of one range without locks - its keys are counting-sorted
+ * by home slot and each goes to the first free slot at or after its home, so
+ * the result is a valid layout for linear probing and Robin Hood alike. A
+ * key that would land past the range is kept for the serial pass.
+ */
+static void *load_place(void *arg)
+{
+    int r = (int)(intptr_t)arg;
+    int lo = range_lo(r), hi = range_lo(r + 1);
+    struct kv_pair *slice = &load.parted[load.range_start[r]];
+    size_t m = load.range_start[r + 1] - load.range_start[r];
+    struct kv_pair *sorted = malloc((m > 0 ? m : 1) * sizeof(struct kv_pair));
+    size_t *start = calloc(hi - lo + 1, sizeof(size_t));
+    if (sorted == NULL || start == NULL)
+    {
+        /* Leave it all to the serial pass */
+        load.overflow[r] = m;
+        free(sorted);
+        free(start);
+        return NULL;
+    }
+
+    /* Stable, so a key that appears twice ends with its last value */
+    for (size_t i = 0; i < m; i++)
+        start[hash_function_fast(slice[i].k, hashTable.mod) - lo + 1]++;
+    for (int h = 0; h < hi - lo; h++)
+        start[h + 1] += start[h];
+    for (size_t i = 0; i < m; i++)
+        sorted[start[hash_function_fast(slice[i].k, hashTable.mod) - lo]++] = slice[i];
+
+    int next_free = lo, group_home = -1, group_start = lo, placed = 0;
+    size_t over = 0;
+    for (size_t i = 0; i < m; i++)
+    {
+        int home = hash_function_fast(sorted[i].k, hashTable.mod);
+        int p = home > next_free ? home : next_free;
+        if (home != group_home)
+        {
+            group_home = home;
+            group_start = p;
+        }
+        /* Same key, same home - an earlier copy sits in this home's run */
+        int q = group_start;
+        while (q < p && q < hi && hashTable.entries[q].key != sorted[i].k)
+            q++;
+        if (q < p && q < hi)
+        {
+            hashTable.entries[q].value = sorted[i].v;
+            continue;
+        }
+        if (p >= hi)
+        {
+            slice[over++] = sorted[i];
+            continue;
+        }
+        HashEntry *e = &hashTable.entries[p];
+        e->key = sorted[i].k;
+        e->value = sorted[i].v;
+        e->dist = p - home;
+        e->is_occupied = SLOT_USED;
+        next_free = p + 1;
+        placed++;
+    }
+    load.overflow[r] = over;
+    load.placed[r] = placed;
+    free(sorted);
+    free(start);
+    return NULL;
+}
+
+/* Run fn(0) .. fn(parts - 1) in parallel and wait for all of them */
+static int load_phase(void *(*fn)(void *))
+{
+    pthread_t tids[load.parts];
+    for (int t = 0; t < load.parts; t++)
+    {
+        if (pthread_create(&tids[t], NULL, fn, (void *)(intptr_t)t) != 0)
+        {
+            perror("pthread_create");
+            for (int j = 0; j < t; j++)
+                pthread_join(tids[j], NULL);
+            return -1;
+        }
+    }
+    for (int t = 0; t < load.parts; t++)
+        pthread_join(tids[t], NULL);
+    return 0;
+}
+
+int bulk_load(struct kv_pair *pairs, size_t n, int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    if (threads > hashTable.size)
+        threads = hashTable.size;
+    load.in = pairs;
+    load.n = n;
+    load.parts = threads;
+    load.offsets = calloc((size_t)threads * threads, sizeof(size_t));
+    load.range_start = calloc(threads + 1, sizeof(size_t));
+    load.parted = malloc((n > 0 ? n : 1) * sizeof(struct kv_pair));
+    load.overflow = calloc(threads, sizeof(size_t));
+    load.placed = calloc(threads, sizeof(int));
+    int rc = -1;
+    if (load.offsets == NULL || load.range_start == NULL || load.parted == NULL ||
+        load.overflow == NULL || load.placed == NULL)
+    {
+        perror("malloc");
+        goto out;
+    }
+
+    /* Partition the input by range: count, turn the counts into offsets
+     * (range-major, so every range's keys stay in input order), scatter */
+    if (load_phase(load_count) < 0)
+        goto out;
+    size_t off = 0;
+    for (int r = 0; r < threads; r++)
+    {
+        load.range_start[r] = off;
+        for (int t = 0; t < threads; t++)
+        {
+            size_t c = load.offsets[t * threads + r];
+            load.offsets[t * threads + r] = off;
+            off += c;
+        }
+    }
+    load.range_start[threads] = off;
+    if (load_phase(load_scatter) < 0 || load_phase(load_place) < 0)
+        goto out;
+
+    /* Keys pushed past their range, with the regular (locked) inserts */
+    for (int r = 0; r < threads; r++)
+    {
+        hashTable.used += load.placed[r];
+        struct kv_pair *slice = &load.parted[load.range_start[r]];
+        for (size_t i = 0; i < load.overflow[r]; i++)
+            put(slice[i].k, slice[i].v);
+    }
+    rc = 0;
+
+out:
+    free(load.offsets);
+    free(load.range_start);
+    free(load.parted);
+    free(load.overflow);
+    free(load.placed);
+    return rc;
+}
+
+int probe_stats(double *avg_probes, double *stddev_probes, int *max_probes)
+{
+    uint64_t total = 0, total_sq = 0;
+    int keys = 0;
+    *max_probes = 0;
+
+    for (int i = 0; i < hashTable.size; i++)
+    {
+        HashEntry *e = &hashTable.entries[i];
+        if (e->is_occupied != SLOT_USED)
+            continue;
+        int home = hash_function_fast(e->key, hashTable.mod);
+        int probes = (i - home + hashTable.size) % hashTable.size + 1;
+        total += probes;
+        total_sq += (uint64_t)probes * probes;
+        keys++;
+        if (probes > *max_probes)
+            *max_probes = probes;
+    }
+    *avg_probes = keys ? (double)total / keys : 0;
+    *stddev_probes = keys ? sqrt((double)total_sq / keys - *avg_probes * *avg_probes) : 0;
+    return keys;
+}
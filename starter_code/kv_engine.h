@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include "common.h"
+#include "ring_buffer.h"
+
+/*
+ * The hash table behind every front end (ring, sockets, replication), kept
+ * apart from the server so it can be linked and benchmarked on its own
+*/
+
+/* Collision resolution of the plain (non-cache) table */
+enum PROBING {
+    PROBE_LINEAR = 0,
+    PROBE_ROBIN_HOOD
+};
+
+/*
+ * Allocate an empty table of size slots - replaces any previous table, so
+ * only call it while no other thread uses the store
+*/
+void initialize_hashTable(int size);
+
+/*
+ * Choose the probing scheme - call before the table is filled, cache mode
+ * always probes linearly
+*/
+void set_probing(enum PROBING probing);
+
+/*
+ * Switch to bounded cache mode, see cache_update/cache_get in kv_engine.c
+ * @param capacity maximum number of live entries
+ * @param default_ttl_ms lifetime of entries PUT without a ttl, 0 for none
+*/
+void initialize_cache(int capacity, uint32_t default_ttl_ms);
+
+/*
+ * Print the cache mode counters to stderr (registered with atexit)
+*/
+void print_cache_stats(void);
+
+/*
+ * Slot states of the cache mode table - walks the whole table, so only call
+ * it while no other thread writes to it
+ * @param tombstones set to the number of slots left marked deleted - 0 once
+ * every removal finished
+ * @return the number of live entries
+*/
+int cache_slot_stats(int *tombstones);
+
+/*
+ * Insert or update a key-value pair - thread-safe
+*/
+void put(key_type k, value_type v);
+
+/*
+ * Look up a key - thread-safe
+ * @return the value associated with k, 0 if k is not in the store
+*/
+value_type get(key_type k);
+
+/*
+ * Apply a request to the store - shared by every front end (ring and sockets)
+ * @param bd request to apply, bd->v is set to the result (and bd->old to the
+ * previous value for INCR, CAS and GETSET) - MGET and MPUT are left alone,
+ * they go through process_multi
+*/
+void process_request(struct buffer_descriptor *bd);
+
+/*
+ * Apply a group of requests in order, prefetching all of their home slots
+ * first so the table's cache misses overlap instead of stalling one by one
+ * @param bds n requests, each bd->v (and bd->old) is set as by process_request
+*/
+void process_requests(struct buffer_descriptor *bds, int n);
+
+/*
+ * Apply an MGET or MPUT - its keys are visited in home slot order, with all
+ * of their slots prefetched first
+ * @param bd the request, bd->v is set to the number of keys applied
+ * @param pairs its batch array (bd->batch_len pairs) - an MGET stores each
+ * key's value in the pair's v
+*/
+void process_multi(struct buffer_descriptor *bd, struct kv_pair *pairs);
+
+/*
+ * Fill an empty table with pairs - call it before any other thread uses the
+ * store. Each thread takes one range of home slots and fills it without
+ * locks, keys whose chain runs past their range are inserted with put
+ * afterwards. Bypasses the replication log and cache mode.
+ * @param pairs n pairs, a key that repeats ends up with its last value
+ * @param threads number of loader threads
+ * @return 0 on success, -1 if memory or threads ran out
+*/
+int bulk_load(struct kv_pair *pairs, size_t n, int threads);
+
+/*
+ * Probe lengths of the current contents - walks the whole table, so only
+ * call it while no other thread writes to it
+ * @param avg_probes set to the average number of slots a GET of a present key visits
+ * @param stddev_probes set to the standard deviation of that number
+ * @param max_probes set to the longest such probe
+ * @return the number of keys in the table
+*/
+int probe_stats(double *avg_probes, double *stddev_probes, int *max_probes);
@@ -6,160 +6,412 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdint.h>
 
 #include "common.h"
 #include "ring_buffer.h"
+#include "kv_engine.h"
+#include "net_server.h"
+#include "replication.h"
+#include "capture.h"
+#include "snapshot.h"
 
-typedef struct
-{
-    key_type key;
-    value_type value;
-    int is_occupied;
-    pthread_mutex_t lock;
-} HashEntry;
+/* Elastic worker pool - workers [0, active_workers) serve the ring and the
+ * rest sleep on pool_cond. pool_controller moves active_workers between
+ * min_workers and max_workers based on the ring backlog and on how many of
+ * the active workers' ring polls actually found work */
+#define MAX_WORKERS 200
+#define POOL_INTERVAL_US 2000
+#define POOL_BACKLOG_PER_WORKER 4
+#define POOL_GROW_UTIL 0.9
+#define POOL_SHRINK_UTIL 0.3
+#define IDLE_POLLS_BEFORE_YIELD 64
+/* Most requests a worker takes from the ring at once (-b), their hash table
+ * slots are prefetched together */
+#define MAX_BATCH 64
 
 typedef struct
 {
-    HashEntry *entries;
-    int size;
-} HashTable;
+    uint64_t ops;   /* requests served */
+    uint64_t polls; /* polls that found the ring empty */
+    char pad[48];   /* one cache line per worker */
+} WorkerStats;
 
-HashTable hashTable;
-pthread_t threads[200];
+pthread_t threads[MAX_WORKERS];
+pthread_t controller;
+WorkerStats worker_stats[MAX_WORKERS];
+/* Weighted round robin between ring lanes - a worker serves up to
+ * lane_weights[l] requests from lane l before moving on to the next lane */
+int lane_weights[NUM_LANES] = { 4, 1 };
+int batch_size = 8;
+int min_workers;
+int max_workers;
+int active_workers;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
 
 struct ring *ringBuffer;
 int isRunning = 1;
+/* -K: SIGKILL the server once it applied this many requests (0: never) */
+uint64_t crash_after;
+/* -k: die halfway through acknowledging that batch instead of before it */
+int crash_midway;
+uint64_t applied_total;
 
-void initialize_hashTable(int size)
+/*
+ * The client stops us with SIGTERM once its run is done - exit normally so
+ * that stdio, the atexit reports and profile data (pgo builds) get flushed.
+ * Every thread blocks SIGTERM and this one takes it with sigwait, so exit
+ * runs in a regular thread rather than in a signal handler, where the
+ * atexit handlers could deadlock on a lock the interrupted thread holds.
+ */
+void *sigterm_thread(void *arg)
 {
-    hashTable.size = size;
-    hashTable.entries = malloc(size * sizeof(HashEntry));
-
-    for (int i = 0; i < size; i++)
-    {
-        hashTable.entries[i].is_occupied = 0;
-        pthread_mutex_init(&hashTable.entries[i].lock, NULL);
-    }
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) != 0)
+        ;
+    exit(EXIT_SUCCESS);
 }
 
-void put(key_type k, value_type v)
+/*
+ * Block the calling worker while it is outside the active part of the pool
+ */
+void park_worker(int id)
 {
-    int index = hash_function(k, hashTable.size);
-    int start = index;
+    pthread_mutex_lock(&pool_lock);
+    while (id >= active_workers)
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
 
-    do
+/*
+ * Take the next request according to the lane weights, skipping empty lanes
+ * @param lane lane this worker is currently serving (worker-local)
+ * @param credit requests left to take from that lane before switching
+ * @return 0 if a request was copied to bd, -1 if every lane was empty
+ */
+int get_next_request(int *lane, int *credit, struct buffer_descriptor *bd)
+{
+    for (int tries = 0; tries < NUM_LANES; tries++)
     {
-        pthread_mutex_lock(&hashTable.entries[index].lock);
-        if (!hashTable.entries[index].is_occupied || hashTable.entries[index].key == k)
+        if (*credit > 0 && ring_try_get_lane(ringBuffer, *lane, bd) == 0)
         {
-            hashTable.entries[index].key = k;
-            hashTable.entries[index].value = v;
-            hashTable.entries[index].is_occupied = 1;
-            pthread_mutex_unlock(&hashTable.entries[index].lock);
-            break;
+            (*credit)--;
+            return 0;
         }
-        pthread_mutex_unlock(&hashTable.entries[index].lock);
-        index = (index + 1) % hashTable.size;
-    } while (index != start);
+        *lane = (*lane + 1) % NUM_LANES;
+        *credit = lane_weights[*lane];
+    }
+    return -1;
 }
 
-value_type get(key_type k)
+void *server_thread(void *arg)
 {
-    int index = hash_function(k, hashTable.size);
-    int start = index;
-    value_type v = 0;
+    int id = (int)(intptr_t)arg;
+    WorkerStats *stats = &worker_stats[id];
+    struct buffer_descriptor bds[MAX_BATCH];
+    char *shared_mem_start = (char *)ringBuffer;
+    int idle_polls = 0;
+    int lane = LANE_READ;
+    int credit = lane_weights[LANE_READ];
 
-    do
+    while (isRunning)
     {
-        pthread_mutex_lock(&hashTable.entries[index].lock);
-        if (hashTable.entries[index].is_occupied && hashTable.entries[index].key == k)
+        if (id >= __atomic_load_n(&active_workers, __ATOMIC_RELAXED))
+            park_worker(id);
+
+        /* Only take what is already queued - never wait to fill a batch */
+        int n = 0;
+        while (n < batch_size && get_next_request(&lane, &credit, &bds[n]) == 0)
+            n++;
+        if (n == 0)
+        {
+            __atomic_store_n(&stats->polls, stats->polls + 1, __ATOMIC_RELAXED);
+            if (++idle_polls == IDLE_POLLS_BEFORE_YIELD)
+            {
+                idle_polls = 0;
+                sched_yield();
+            }
+            continue;
+        }
+        idle_polls = 0;
+        capture_append(id, bds, n);
+        for (int i = 0; i < n; i++)
         {
-            v = hashTable.entries[index].value;
-            pthread_mutex_unlock(&hashTable.entries[index].lock);
-            break;
+            if (bds[i].t_submit)
+                bds[i].t_dequeue = now_ns();
         }
-        pthread_mutex_unlock(&hashTable.entries[index].lock);
-        index = (index + 1) % hashTable.size;
-    } while (index != start && hashTable.entries[index].is_occupied);
+        /* Batch order is queue order - an MGET/MPUT is applied between the
+         * runs of single-key requests around it */
+        int run = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (bds[i].req_type != MGET && bds[i].req_type != MPUT)
+                continue;
+            process_requests(&bds[run], i - run);
+            process_multi(&bds[i], (struct kv_pair *)(shared_mem_start + bds[i].batch_off));
+            run = i + 1;
+        }
+        process_requests(&bds[run], n - run);
+        __atomic_store_n(&stats->ops, stats->ops + n, __ATOMIC_RELAXED);
 
-    return v;
+        /* Die with the batch applied but not acknowledged - the standby has
+         * to finish it (failover test) */
+        int crash = crash_after && __atomic_add_fetch(&applied_total, n, __ATOMIC_RELAXED) >= crash_after;
+        if (crash && !crash_midway)
+            raise(SIGKILL);
+
+        for (int i = 0; i < n; i++)
+        {
+            if (bds[i].t_submit)
+                bds[i].t_applied = now_ns();
+            ring_complete(ringBuffer, &bds[i]);
+            /* -k: leave a request completed but not posted */
+            if (crash && i == n / 2)
+                raise(SIGKILL);
+            ring_post(ringBuffer, &bds[i]);
+            ring_release(ringBuffer, &bds[i]);
+        }
+    }
+    return NULL;
 }
 
-void *server_thread(void *arg)
+/*
+ * Resize the active part of the worker pool every POOL_INTERVAL_US
+ * Grows when the backlog is more than the active workers can absorb or they
+ * are nearly always busy, shrinks when the ring is drained and they are mostly
+ * polling an empty ring
+ */
+void *pool_controller(void *arg)
 {
-    struct buffer_descriptor bd;
-    char *shared_mem_start = (char *)ringBuffer;
+    (void)arg;
+    uint64_t last_ops[MAX_WORKERS] = {0};
+    uint64_t last_polls[MAX_WORKERS] = {0};
 
     while (isRunning)
     {
-        ring_get(ringBuffer, &bd);
-        if (bd.req_type == PUT)
+        usleep(POOL_INTERVAL_US);
+
+        int active = active_workers;
+        uint64_t ops = 0, polls = 0;
+        for (int i = 0; i < max_workers; i++)
         {
-            put(bd.k, bd.v);
+            uint64_t o = __atomic_load_n(&worker_stats[i].ops, __ATOMIC_RELAXED);
+            uint64_t p = __atomic_load_n(&worker_stats[i].polls, __ATOMIC_RELAXED);
+            if (i < active)
+            {
+                ops += o - last_ops[i];
+                polls += p - last_polls[i];
+            }
+            last_ops[i] = o;
+            last_polls[i] = p;
         }
-        else if (bd.req_type == GET)
+        double util = (ops + polls) ? (double)ops / (ops + polls) : 0;
+        uint32_t backlog = ring_count(ringBuffer);
+
+        int target = active;
+        if ((backlog > (uint32_t)active * POOL_BACKLOG_PER_WORKER || util > POOL_GROW_UTIL) && active < max_workers)
+            target = active + 1;
+        else if (backlog == 0 && util < POOL_SHRINK_UTIL && active > min_workers)
+            target = active - 1;
+
+        if (target != active)
         {
-            bd.v = get(bd.k);
+            pthread_mutex_lock(&pool_lock);
+            __atomic_store_n(&active_workers, target, __ATOMIC_RELAXED);
+            pthread_cond_broadcast(&pool_cond);
+            pthread_mutex_unlock(&pool_lock);
         }
-
-        struct buffer_descriptor *result = (struct buffer_descriptor *)(shared_mem_start + bd.res_off);
-        memcpy(result, &bd, sizeof(struct buffer_descriptor));
-        result->ready = 1;
     }
     return NULL;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Get the value of a "-x value" style argument
+ * fork_server passes the flag and value as a single argv entry ("-n 4"), so the
+ * value may follow in the same string or in the next argv entry
+ * @param i index of the flag in argv, advanced if the value is in the next entry
+ */
+char *parse_str_arg(int argc, char *argv[], int *i)
 {
-    int num_threads = 0;
-    int table_size = 200;
-    char *shm_file = "shmem_file";
-    int fd = open(shm_file, O_RDWR);
-    struct stat file_stat;
+    char *val = argv[*i] + 2;
+    while (*val == ' ')
+        val++;
+    if (*val == '\0' && *i + 1 < argc)
+        val = argv[++(*i)];
+    return val;
+}
 
+int parse_num_arg(int argc, char *argv[], int *i)
+{
+    return atoi(parse_str_arg(argc, argv, i));
+}
+
+/*
+ * Map the ring and the status board
+ * @param shm_fd memfd passed by the client with -d, or -1 to open shm_file
+ * @return the ring at the start of the region, NULL on failure
+ */
+struct ring *map_shared_ring(int shm_fd, char *shm_file)
+{
+    struct stat file_stat;
+    int fd = shm_fd >= 0 ? shm_fd : open(shm_file, O_RDWR);
     if (fd < 0)
     {
         printf("ERROR: Cannot open shared memory.\n");
-        return EXIT_FAILURE;
+        return NULL;
     }
     if (fstat(fd, &file_stat) == -1)
     {
         perror("ERROR: Cannot get stats\n");
-        return EXIT_FAILURE;
+        close(fd);
+        return NULL;
     }
-    void *shared = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* Prefault the ring and status board so the first requests don't page fault */
+    void *shared = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
     close(fd);
 
     if (shared == MAP_FAILED)
     {
         perror("Failed to map shared memory");
-        return EXIT_FAILURE;
+        return NULL;
     }
+    madvise(shared, file_stat.st_size, MADV_HUGEPAGE);
+    return (struct ring *)shared;
+}
+
+/*
+ * Fill the table from a snapshot file with bulk_load and report how long
+ * reading and inserting took
+ * @return 0 on success, -1 otherwise
+ */
+int load_snapshot(const char *path, int threads)
+{
+    struct kv_pair *pairs;
+    size_t n;
+    uint64_t start = now_ns();
+    if (snapshot_read(path, &pairs, &n) < 0)
+        return -1;
+    uint64_t read_done = now_ns();
+    int rc = bulk_load(pairs, n, threads);
+    uint64_t done = now_ns();
+    free(pairs);
+    if (rc == 0)
+        fprintf(stderr, "Loaded %zu pairs from %s with %d threads: read %.1f ms, insert %.1f ms\n", n, path,
+                threads, (read_done - start) / 1e6, (done - read_done) / 1e6);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    int num_threads = 0;
+    int min_threads = -1;
+    int cache_capacity = 0;
+    int default_ttl_ms = 0;
+    int replicate = 0;
+    int standby_of = 0;
+    enum PROBING probing = PROBE_LINEAR;
+    int table_size = 200;
+    int shm_fd = -1;
+    int tcp_port = 0;
+    char *unix_path = NULL;
+    char *capture_path = NULL;
+    char *snapshot_path = NULL;
+    char *shm_file = "shmem_file";
 
-    ringBuffer = (struct ring *)shared;
     for (int i = 1; i < argc; i++)
     {
         if ((argv[i][0] == '-') && (argv[i][1] == 'n'))
         {
-            int num_len = 0;
-            while (argv[i][num_len++] != '\0') {}
-            char* num = malloc(sizeof(char) * num_len);
-            num = strncpy(num, argv[i], num_len);
-            char* num_orig = num;
-            strsep(&num, " ");
-            num_threads = atoi(num);
-            free(num_orig);
+            num_threads = parse_num_arg(argc, argv, &i);
         }
         else if ((argv[i][0] == '-') && (argv[i][1] == 's'))
         {
-            int num_len = 0;
-            while (argv[i][num_len++] != '\0') {}
-            char* num = malloc(sizeof(char) * num_len);
-            num = strncpy(num, argv[i], num_len);
-            char* num_orig = num;
-            strsep(&num, " ");
-            table_size = atoi(num);
-            free(num_orig);
+            table_size = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'm'))
+        {
+            min_threads = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'w'))
+        {
+            /* -w get_weight,put_weight */
+            char *weights = parse_str_arg(argc, argv, &i);
+            if (sscanf(weights, "%d,%d", &lane_weights[LANE_READ], &lane_weights[LANE_WRITE]) != 2 ||
+                lane_weights[LANE_READ] <= 0 || lane_weights[LANE_WRITE] <= 0)
+            {
+                printf("ERROR: -w expects two positive lane weights (get,put)\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'b'))
+        {
+            batch_size = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'c'))
+        {
+            cache_capacity = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'e'))
+        {
+            default_ttl_ms = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'r'))
+        {
+            replicate = 1;
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'R'))
+        {
+            standby_of = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'o'))
+        {
+            /* -o linear|robin */
+            char *scheme = parse_str_arg(argc, argv, &i);
+            if (!strcmp(scheme, "robin"))
+                probing = PROBE_ROBIN_HOOD;
+            else if (strcmp(scheme, "linear"))
+            {
+                printf("ERROR: -o expects linear or robin\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'd'))
+        {
+            shm_fd = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'p'))
+        {
+            tcp_port = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'u'))
+        {
+            unix_path = parse_str_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'l'))
+        {
+            /* -l file: fill the table from a snapshot before serving */
+            snapshot_path = parse_str_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'C'))
+        {
+            /* -C file: record every request taken from the ring, for client -P */
+            capture_path = parse_str_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'K'))
+        {
+            /* -K n: crash after applying n requests, to test failover -
+             * a standby (-R) takes the same arguments and ignores it */
+            crash_after = parse_num_arg(argc, argv, &i);
+        }
+        else if ((argv[i][0] == '-') && (argv[i][1] == 'k'))
+        {
+            /* -k n: like -K n, but die between completing and posting */
+            crash_after = parse_num_arg(argc, argv, &i);
+            crash_midway = 1;
         }
         else
         {
@@ -168,22 +420,130 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (num_threads <= 0 || table_size <= 0)
+    int use_net = tcp_port > 0 || unix_path != NULL;
+    /* Without -m the pool is fixed at -n workers */
+    if (min_threads < 0 || min_threads > num_threads)
+        min_threads = num_threads;
+    if (num_threads < 0 || table_size <= 0 || cache_capacity < 0 || default_ttl_ms < 0 || standby_of < 0)
     {
         printf("ERROR: values are negative or not all values completed\n");
         exit(EXIT_FAILURE);
     }
+    if (num_threads > MAX_WORKERS)
+    {
+        printf("ERROR: -n takes at most %d workers\n", MAX_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+    if (batch_size <= 0 || batch_size > MAX_BATCH)
+    {
+        printf("ERROR: -b must be between 1 and %d\n", MAX_BATCH);
+        exit(EXIT_FAILURE);
+    }
+    if (cache_capacity > 0 && probing != PROBE_LINEAR)
+    {
+        printf("ERROR: cache mode (-c) only works with -o linear\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cache_capacity > 0 && cache_capacity >= table_size)
+    {
+        printf("ERROR: cache capacity (-c) must be smaller than the table size (-s)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (cache_capacity > 0 && snapshot_path != NULL)
+    {
+        printf("ERROR: cache mode (-c) can't load a snapshot (-l)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (replicate && standby_of)
+    {
+        printf("ERROR: a server is either the primary (-r) or a standby (-R)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (num_threads == 0 && !use_net)
+    {
+        printf("ERROR: -n 0 needs a socket front end (-p or -u)\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* The ring is optional when a socket front end is configured (-n 0 skips it) */
+    if (num_threads > 0)
+        ringBuffer = map_shared_ring(shm_fd, shm_file);
+    if (ringBuffer == NULL && !use_net)
+    {
+        return EXIT_FAILURE;
+    }
 
+    set_probing(probing);
     initialize_hashTable(table_size);
+    if (cache_capacity > 0)
+    {
+        initialize_cache(cache_capacity, default_ttl_ms);
+        atexit(print_cache_stats);
+    }
+    /* Before any other thread exists, so they all inherit the mask */
+    static sigset_t term_set;
+    pthread_t sigterm_tid;
+    sigemptyset(&term_set);
+    sigaddset(&term_set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &term_set, NULL);
+    if (pthread_create(&sigterm_tid, NULL, sigterm_thread, &term_set) != 0)
+    {
+        perror("Failed to create thread");
+        return EXIT_FAILURE;
+    }
+
+    /* Before anything can reach the table, with one loader per worker */
+    if (snapshot_path != NULL && load_snapshot(snapshot_path, num_threads > 0 ? num_threads : 1) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (replicate && repl_start_primary() < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    /* A standby only replays the primary's log until it has to take over */
+    if (standby_of > 0 && repl_follow(standby_of, ringBuffer) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if (standby_of > 0)
+        crash_after = 0;
 
+    if (capture_path != NULL && ringBuffer != NULL && capture_start(capture_path, num_threads, (char *)ringBuffer) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (use_net && net_server_start(tcp_port, unix_path) < 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (ringBuffer == NULL)
+    {
+        /* Sockets only - the epoll thread does all the work */
+        while (1)
+            pause();
+    }
+
+    /* Start at the minimum, the controller adds workers as load shows up */
+    min_workers = min_threads > 0 ? min_threads : 1;
+    max_workers = num_threads;
+    active_workers = min_workers;
     for (int i = 0; i < num_threads; i++)
     {
-        if (pthread_create(&threads[i], NULL, server_thread, NULL) != 0)
+        if (pthread_create(&threads[i], NULL, server_thread, (void *)(intptr_t)i) != 0)
         {
             perror("Failed to create thread");
             return EXIT_FAILURE;
         }
     }
+    if (min_workers < max_workers && pthread_create(&controller, NULL, pool_controller, NULL) != 0)
+    {
+        perror("Failed to create thread");
+        return EXIT_FAILURE;
+    }
 
     for (int i = 0; i < num_threads; i++)
     {
@@ -191,4 +551,4 @@ int main(int argc, char *argv[])
     }
 
     return 0;
-}
\ No newline at end of file
+}
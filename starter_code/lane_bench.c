@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "ring_buffer.h"
+#include "bench_util.h"
+
+/*
+ * GET latency under a bulk load
+ * Forks ./server, then runs loader threads that stream PUTs with a deep
+ * window next to reader threads that issue one timed GET at a time. Prints
+ * the readers' latency percentiles and the loaders' throughput.
+ * -F puts every request in a single FIFO lane to compare against the split
+ * read/write lanes, -W sets the server's lane weights.
+*/
+
+#define MAX_THREADS 64
+
+struct thread_context {
+	int tid;
+	struct buffer_descriptor *comps; /* this thread's windows in the status board */
+	int comp_off;
+	double *lat_us; /* readers only */
+};
+
+char shm_file[] = "shmem_file";
+char *shmem_area;
+struct ring *ring;
+int put_threads = 2;
+int get_threads = 2;
+int puts_per_thread = 200000;
+int gets_per_thread = 5000;
+int put_win = 64;
+int fifo = 0;
+int s_num_threads = 2;
+char s_weights[32] = "4,1";
+double *latencies;
+pthread_t threads[MAX_THREADS];
+struct thread_context contexts[MAX_THREADS];
+
+pid_t start_server() {
+	int shm_size = sizeof(struct ring) +
+		(put_threads * put_win + get_threads) * sizeof(struct buffer_descriptor);
+	int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd < 0 || ftruncate(fd, shm_size) == -1) {
+		perror("shmem_file");
+		exit(EXIT_FAILURE);
+	}
+	shmem_area = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (shmem_area == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	memset(shmem_area, 0, shm_size);
+	ring = (struct ring *)shmem_area;
+	if (init_ring(ring) < 0)
+		exit(EXIT_FAILURE);
+	ring->split_lanes = !fifo;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char n[32], s[32], w[40];
+		sprintf(n, "-n %d", s_num_threads);
+		sprintf(s, "-s %d", puts_per_thread * put_threads * 2);
+		sprintf(w, "-w %s", s_weights);
+		execl("./server", "./server", n, s, w, (char *)NULL);
+		perror("execl");
+		exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+void wait_ready(struct buffer_descriptor *comp) {
+	while (__atomic_load_n(&comp->ready, __ATOMIC_ACQUIRE) != 1)
+		sched_yield();
+	comp->ready = 0;
+}
+
+/* Streams PUTs on distinct keys with up to put_win in flight */
+void *loader_function(void *arg) {
+	struct thread_context *ctx = arg;
+	struct buffer_descriptor bd;
+	int submitted = 0, completed = 0;
+
+	while (completed < puts_per_thread) {
+		while (submitted < puts_per_thread && submitted - completed < put_win) {
+			memset(&bd, 0, sizeof(bd));
+			bd.req_type = PUT;
+			bd.k = ctx->tid * puts_per_thread + submitted + 1;
+			bd.v = submitted + 1;
+			bd.res_off = ctx->comp_off + (submitted % put_win) * sizeof(struct buffer_descriptor);
+			ring_submit(ring, &bd);
+			submitted++;
+		}
+		wait_ready(&ctx->comps[completed % put_win]);
+		completed++;
+	}
+	return NULL;
+}
+
+/* One timed GET at a time on random keys */
+void *reader_function(void *arg) {
+	struct thread_context *ctx = arg;
+	struct buffer_descriptor bd;
+	unsigned int seed = ctx->tid;
+
+	for (int i = 0; i < gets_per_thread; i++) {
+		memset(&bd, 0, sizeof(bd));
+		bd.req_type = GET;
+		bd.k = rand_r(&seed) % (put_threads * puts_per_thread) + 1;
+		bd.res_off = ctx->comp_off;
+		double start = now_us();
+		ring_submit(ring, &bd);
+		wait_ready(ctx->comps);
+		ctx->lat_us[i] = now_us() - start;
+	}
+	return NULL;
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-p put_threads] [-g get_threads] [-P puts_per_thread] [-G gets_per_thread] "
+			"[-w put_window] [-t server_threads] [-W get_weight,put_weight] [-F]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hp:g:P:G:w:t:W:F")) != -1) {
+		switch (op) {
+		case 'p':
+		put_threads = atoi(optarg);
+		break;
+
+		case 'g':
+		get_threads = atoi(optarg);
+		break;
+
+		case 'P':
+		puts_per_thread = atoi(optarg);
+		break;
+
+		case 'G':
+		gets_per_thread = atoi(optarg);
+		break;
+
+		case 'w':
+		put_win = atoi(optarg);
+		break;
+
+		case 't':
+		s_num_threads = atoi(optarg);
+		break;
+
+		case 'W':
+		strncpy(s_weights, optarg, sizeof(s_weights) - 1);
+		break;
+
+		case 'F':
+		fifo = 1;
+		break;
+
+		default:
+		usage(argv[0]);
+		exit(op == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (put_threads < 0 || get_threads <= 0 || put_threads + get_threads > MAX_THREADS ||
+			put_win <= 0 || gets_per_thread <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	latencies = malloc(get_threads * gets_per_thread * sizeof(double));
+	pid_t pid = start_server();
+
+	double start = now_us();
+	int comp_off = sizeof(struct ring);
+	for (int i = 0; i < put_threads + get_threads; i++) {
+		int loader = i < put_threads;
+		contexts[i].tid = i;
+		contexts[i].comp_off = comp_off;
+		contexts[i].comps = (struct buffer_descriptor *)(shmem_area + comp_off);
+		contexts[i].lat_us = loader ? NULL : latencies + (i - put_threads) * gets_per_thread;
+		comp_off += (loader ? put_win : 1) * sizeof(struct buffer_descriptor);
+		if (pthread_create(&threads[i], NULL, loader ? loader_function : reader_function, &contexts[i]))
+			perror("pthread_create");
+	}
+	for (int i = 0; i < put_threads + get_threads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_us() - start;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	int n = get_threads * gets_per_thread;
+	sort_samples(latencies, n);
+	printf("Lanes: %s (weights %s)\n", fifo ? "single fifo" : "split", s_weights);
+	printf("GET latency (us): p50 %.1f p99 %.1f max %.1f\n",
+			percentile(latencies, n, 0.5), percentile(latencies, n, 0.99), percentile(latencies, n, 1));
+	printf("PUT throughput: %.1f K/s\n", put_threads * puts_per_thread * 1e3 / elapsed);
+	return 0;
+}
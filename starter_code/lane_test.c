@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "common.h"
+#include "ring_buffer.h"
+
+/*
+ * Lane routing test - a client's PUT x and then GET x must be applied in
+ * that order even while another client's MPUT on a key of the same key slot
+ * waits in ring_submit for LANE_READ to drain, i.e. while the slot is
+ * pending in both lanes. The sequence is:
+ *   1. a GET x is queued and not taken yet (LANE_READ is pending)
+ *   2. an MPUT on x + LANE_KEY_SLOTS starts submitting (LANE_WRITE pending)
+ *   3. another thread submits PUT x, then GET x
+ * Then a consumer that always prefers LANE_WRITE drains the ring - the
+ * worst order a pool of server threads could produce - and the PUT has to
+ * come out before the second GET, both in the same lane.
+*/
+
+#define SETTLE_US 100000
+#define MULTI_KEYS 4
+
+struct ring *ring;
+key_type x = 7;
+
+void submit(enum REQUEST_TYPE t, key_type k, int batch_off, uint32_t batch_len, uint32_t id) {
+	struct buffer_descriptor bd;
+	memset(&bd, 0, sizeof(bd));
+	bd.req_type = t;
+	bd.k = k;
+	bd.v = id;
+	bd.id = id;
+	bd.batch_off = batch_off;
+	bd.batch_len = batch_len;
+	ring_submit(ring, &bd);
+}
+
+void *multi_function(void *arg) {
+	(void)arg;
+	submit(MPUT, 0, sizeof(struct ring), MULTI_KEYS, 2);
+	return NULL;
+}
+
+void *client_function(void *arg) {
+	(void)arg;
+	submit(PUT, x, 0, 0, 3);
+	submit(GET, x, 0, 0, 4);
+	return NULL;
+}
+
+int main() {
+	ring = aligned_alloc(64, (sizeof(struct ring) + MULTI_KEYS * sizeof(struct kv_pair) + 63) & ~63UL);
+	if (ring == NULL || init_ring(ring) < 0) {
+		printf("Failed to set up the ring\n");
+		return EXIT_FAILURE;
+	}
+	struct kv_pair *pairs = (struct kv_pair *)((char *)ring + sizeof(struct ring));
+	for (int i = 0; i < MULTI_KEYS; i++) {
+		pairs[i].k = x + (i + 1) * LANE_KEY_SLOTS;
+		pairs[i].v = i + 1;
+	}
+
+	pthread_t multi, client;
+	submit(GET, x, 0, 0, 1);
+	pthread_create(&multi, NULL, multi_function, NULL);
+	while (ring_pending(ring, LANE_WRITE, x % LANE_KEY_SLOTS) == 0)
+		usleep(100);
+	pthread_create(&client, NULL, client_function, NULL);
+	usleep(SETTLE_US);
+
+	/* Consume all 4 requests, LANE_WRITE first */
+	int put_at = -1, get_at = -1, put_lane = -1, get_lane = -1;
+	for (int taken = 0; taken < 4; ) {
+		struct buffer_descriptor bd;
+		if (ring_try_get_lane(ring, LANE_WRITE, &bd) < 0 && ring_try_get_lane(ring, LANE_READ, &bd) < 0)
+			continue;
+		if (bd.id == 3) {
+			put_at = taken;
+			put_lane = bd.lane;
+		} else if (bd.id == 4) {
+			get_at = taken;
+			get_lane = bd.lane;
+		}
+		ring_complete(ring, &bd);
+		ring_release(ring, &bd);
+		taken++;
+	}
+	pthread_join(multi, NULL);
+	pthread_join(client, NULL);
+
+	if (put_at > get_at || put_lane != get_lane) {
+		printf("PUT x was taken %s GET x (lanes %d and %d) - GET reads a stale value\n",
+				put_at > get_at ? "after" : "before", put_lane, get_lane);
+		return EXIT_FAILURE;
+	}
+	printf("PUT x and GET x stayed in order in lane %d\n", put_lane);
+	return EXIT_SUCCESS;
+}
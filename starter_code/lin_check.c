@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Offline linearizability checker for histories written by client -H
+ * Every key is an independent register (get of a missing key returns 0), so
+ * the history is linearizable iff each key's sub-history is. Each key is
+ * searched Wing & Gong style: repeatedly pick a pending operation that no
+ * other pending one finished before, apply it to the register and backtrack
+ * on a get that doesn't match. A read-modify-write (INCR, CAS, GETSET) is
+ * recorded with the old and new values it returned, so it can go wherever
+ * the register holds old and leaves new behind. As in Lowe's variant, every
+ * (set of linearized ops, register value) pair that was already explored is
+ * memoized, which keeps the search close to linear on real histories. The
+ * search keeps its own stack on the heap, so a key may have any number of ops.
+ * Usage: lin_check [-v] [-b max_states_per_key] history_file
+ * Cache mode histories (TTL expiry, eviction) are not registers, so don't
+ * check them.
+*/
+
+#define LINE_LEN 256
+#define DEFAULT_MAX_STATES (1 << 22)
+
+enum OP_TYPE {
+	OP_PUT,
+	OP_GET,
+	OP_RMW
+};
+
+struct op {
+	uint32_t k;
+	uint32_t v; /* put: value written, get: value returned, rmw: value after */
+	uint32_t old; /* rmw: value before */
+	enum OP_TYPE type;
+	uint64_t inv;
+	uint64_t resp;
+};
+
+/* One key's search state */
+struct search {
+	struct op *ops;
+	int n;
+	int words;
+	uint64_t *done; /* bitset of linearized ops */
+	/* memo: open addressing on (bitset, value). Every op before the first
+	 * pending one is linearized, and none invoked after that one responded
+	 * can be yet (see state_words), so a bitset is stored as the index of
+	 * the first pending op plus the words of done in between, in pool */
+	uint64_t *memo_hash;
+	uint32_t *memo_val;
+	int *memo_first;
+	size_t *memo_off;
+	uint64_t *pool;
+	size_t pool_len;
+	size_t pool_cap;
+	size_t memo_cap;
+	size_t memo_len;
+	size_t max_states;
+	int exhausted;
+};
+
+/* One level of the search, see linearize */
+struct frame {
+	uint32_t val; /* register value before the level's op */
+	int first; /* first pending op */
+	int next; /* next op to try */
+	uint64_t min_resp; /* earliest response of a pending op */
+};
+
+int verbose = 0;
+
+int cmp_op(const void *a, const void *b) {
+	const struct op *x = a, *y = b;
+	if (x->k != y->k)
+		return x->k < y->k ? -1 : 1;
+	return (x->inv > y->inv) - (x->inv < y->inv);
+}
+
+#define IS_DONE(s, i) ((s)->done[(i) / 64] & (1ULL << ((i) % 64)))
+#define FLIP(s, i) ((s)->done[(i) / 64] ^= (1ULL << ((i) % 64)))
+
+/*
+ * Words of done that a state with first pending op first can differ in -
+ * from first's word to the word of the last op invoked before first
+ * responded, since a later op can't be linearized ahead of first
+*/
+int state_words(struct search *s, int first) {
+	if (first == s->n)
+		return 0;
+	int lo = first, hi = s->n - 1;
+	while (lo < hi) {
+		int mid = lo + (hi - lo + 1) / 2;
+		if (s->ops[mid].inv <= s->ops[first].resp)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo / 64 - first / 64 + 1;
+}
+
+uint64_t hash_state(struct search *s, uint32_t val, int first, int words) {
+	uint64_t h = (1469598103934665603ULL ^ val) * 1099511628211ULL;
+	h = (h ^ (uint32_t)first) * 1099511628211ULL;
+	for (int i = 0; i < words; i++)
+		h = (h ^ s->done[first / 64 + i]) * 1099511628211ULL;
+	return h | 1; /* 0 marks an empty slot */
+}
+
+int memo_grow(struct search *s) {
+	size_t cap = s->memo_cap ? s->memo_cap * 2 : 1024;
+	uint64_t *hash = calloc(cap, sizeof(uint64_t));
+	uint32_t *val = malloc(cap * sizeof(uint32_t));
+	int *first = malloc(cap * sizeof(int));
+	size_t *off = malloc(cap * sizeof(size_t));
+	if (hash == NULL || val == NULL || first == NULL || off == NULL) {
+		free(hash);
+		free(val);
+		free(first);
+		free(off);
+		return -1;
+	}
+	for (size_t i = 0; i < s->memo_cap; i++) {
+		if (s->memo_hash[i] == 0)
+			continue;
+		size_t j = s->memo_hash[i] & (cap - 1);
+		while (hash[j] != 0)
+			j = (j + 1) & (cap - 1);
+		hash[j] = s->memo_hash[i];
+		val[j] = s->memo_val[i];
+		first[j] = s->memo_first[i];
+		off[j] = s->memo_off[i];
+	}
+	free(s->memo_hash);
+	free(s->memo_val);
+	free(s->memo_first);
+	free(s->memo_off);
+	s->memo_hash = hash;
+	s->memo_val = val;
+	s->memo_first = first;
+	s->memo_off = off;
+	s->memo_cap = cap;
+	return 0;
+}
+
+/*
+ * Remember the current (done, val) state
+ * @param first the first op that isn't done
+ * @return 1 if it's new, 0 if it was explored before (or the budget ran out)
+*/
+int memo_insert(struct search *s, uint32_t val, int first) {
+	int words = state_words(s, first);
+	if (s->memo_len >= s->max_states || (2 * (s->memo_len + 1) > s->memo_cap && memo_grow(s) < 0)) {
+		s->exhausted = 1;
+		return 0;
+	}
+	if (s->pool_len + words > s->pool_cap) {
+		size_t cap = s->pool_cap ? s->pool_cap * 2 : 1024;
+		while (cap < s->pool_len + words)
+			cap *= 2;
+		uint64_t *pool = realloc(s->pool, cap * sizeof(uint64_t));
+		if (pool == NULL) {
+			s->exhausted = 1;
+			return 0;
+		}
+		s->pool = pool;
+		s->pool_cap = cap;
+	}
+	uint64_t *bits = s->done + first / 64;
+	uint64_t h = hash_state(s, val, first, words);
+	size_t j = h & (s->memo_cap - 1);
+	while (s->memo_hash[j] != 0) {
+		if (s->memo_hash[j] == h && s->memo_val[j] == val && s->memo_first[j] == first &&
+				!memcmp(s->pool + s->memo_off[j], bits, words * sizeof(uint64_t)))
+			return 0;
+		j = (j + 1) & (s->memo_cap - 1);
+	}
+	s->memo_hash[j] = h;
+	s->memo_val[j] = val;
+	s->memo_first[j] = first;
+	s->memo_off[j] = s->pool_len;
+	memcpy(s->pool + s->pool_len, bits, words * sizeof(uint64_t));
+	s->pool_len += words;
+	s->memo_len++;
+	return 1;
+}
+
+/* Start a level at register value val - first is a lower bound */
+void enter(struct search *s, struct frame *f, uint32_t val, int first) {
+	while (first < s->n && IS_DONE(s, first))
+		first++;
+
+	/* Only ops invoked before every pending op responded can go next - and
+	 * an op invoked after that can't respond any earlier */
+	uint64_t min_resp = UINT64_MAX;
+	for (int i = first; i < s->n && s->ops[i].inv <= min_resp; i++)
+		if (!IS_DONE(s, i) && s->ops[i].resp < min_resp)
+			min_resp = s->ops[i].resp;
+
+	f->val = val;
+	f->first = first;
+	f->next = first;
+	f->min_resp = min_resp;
+}
+
+/*
+ * Try to linearize the key's ops from an empty register - a depth first
+ * search with one frame per linearized op. The op a frame tried last is
+ * next - 1, which is taken back when its subtree turns out to be a dead end
+ * @return 1 if a linearization exists
+*/
+int linearize(struct search *s) {
+	struct frame *stack = malloc((s->n + 1) * sizeof(struct frame));
+	if (stack == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	int depth = 0, found = 0;
+	enter(s, &stack[0], 0, 0);
+
+	while (depth >= 0 && !s->exhausted) {
+		if (depth == s->n) {
+			found = 1;
+			break;
+		}
+		struct frame *f = &stack[depth];
+		int pushed = 0;
+		for (; f->next < s->n && s->ops[f->next].inv <= f->min_resp; f->next++) {
+			int i = f->next;
+			if (IS_DONE(s, i))
+				continue;
+			struct op *o = &s->ops[i];
+			if ((o->type == OP_GET && o->v != f->val) || (o->type == OP_RMW && o->old != f->val))
+				continue;
+			uint32_t next = o->type == OP_GET ? f->val : o->v;
+
+			FLIP(s, i);
+			int first = f->first;
+			while (first < s->n && IS_DONE(s, first))
+				first++;
+			if (memo_insert(s, next, first)) {
+				f->next++;
+				enter(s, &stack[++depth], next, first);
+				pushed = 1;
+				break;
+			}
+			FLIP(s, i);
+			if (s->exhausted)
+				break;
+		}
+		if (pushed)
+			continue;
+		/* Every op that could go here failed - take back the one before */
+		if (--depth >= 0)
+			FLIP(s, stack[depth].next - 1);
+	}
+	free(stack);
+	return found;
+}
+
+void print_key(struct op *ops, int n) {
+	const char *names[] = { "put", "get", "rmw" };
+	fprintf(stderr, "  %-4s %10s %10s %20s %20s\n", "op", "old", "value", "invoked (ns)", "responded (ns)");
+	for (int i = 0; i < n; i++) {
+		char old[16] = "-";
+		if (ops[i].type == OP_RMW)
+			sprintf(old, "%u", ops[i].old);
+		fprintf(stderr, "  %-4s %10s %10u %20lu %20lu\n", names[ops[i].type], old,
+				ops[i].v, ops[i].inv, ops[i].resp);
+	}
+}
+
+/*
+ * Check the sub-history of a single key
+ * @return 0 if it's linearizable, 1 if it isn't, 2 if the search gave up
+*/
+int check_key(struct op *ops, int n, size_t max_states) {
+	struct search s;
+	memset(&s, 0, sizeof(s));
+	s.ops = ops;
+	s.n = n;
+	s.words = (n + 63) / 64;
+	s.max_states = max_states;
+	s.done = calloc(s.words, sizeof(uint64_t));
+	if (s.done == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	int rc = linearize(&s) ? 0 : (s.exhausted ? 2 : 1);
+	if (verbose)
+		printf("key %u: %d ops, %zu states\n", ops[0].k, n, s.memo_len);
+	free(s.done);
+	free(s.memo_hash);
+	free(s.memo_val);
+	free(s.memo_first);
+	free(s.memo_off);
+	free(s.pool);
+	return rc;
+}
+
+struct op *read_history(char *file, int *num_ops) {
+	FILE *f = fopen(file, "r");
+	if (f == NULL) {
+		perror("fopen");
+		exit(EXIT_FAILURE);
+	}
+	char line[LINE_LEN];
+	int cap = 1024, n = 0;
+	struct op *ops = malloc(cap * sizeof(struct op));
+	while (fgets(line, LINE_LEN, f) != NULL) {
+		char type[8];
+		struct op o;
+		memset(&o, 0, sizeof(o));
+		int fields = sscanf(line, "%7s", type) == 1 && !strcmp(type, "rmw") ?
+			sscanf(line, "%7s %u %u %u %lu %lu", type, &o.k, &o.old, &o.v, &o.inv, &o.resp) - 1 :
+			sscanf(line, "%7s %u %u %lu %lu", type, &o.k, &o.v, &o.inv, &o.resp);
+		if (fields != 5 || (strcmp(type, "put") && strcmp(type, "get") && strcmp(type, "rmw"))) {
+			fprintf(stderr, "Skipping malformed line: %s", line);
+			continue;
+		}
+		o.type = !strcmp(type, "put") ? OP_PUT : (!strcmp(type, "get") ? OP_GET : OP_RMW);
+		if (n == cap) {
+			cap *= 2;
+			ops = realloc(ops, cap * sizeof(struct op));
+		}
+		ops[n++] = o;
+	}
+	fclose(f);
+	*num_ops = n;
+	return ops;
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-v] [-b max_states_per_key] history_file\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	size_t max_states = DEFAULT_MAX_STATES;
+	char *file = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-v"))
+			verbose = 1;
+		else if (!strcmp(argv[i], "-b") && i + 1 < argc)
+			max_states = strtoul(argv[++i], NULL, 10);
+		else if (argv[i][0] != '-' && file == NULL)
+			file = argv[i];
+		else {
+			usage(argv[0]);
+			exit(strcmp(argv[i], "-h") ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+	if (file == NULL) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int n;
+	struct op *ops = read_history(file, &n);
+	qsort(ops, n, sizeof(struct op), cmp_op);
+
+	int keys = 0, bad = 0, unknown = 0;
+	for (int start = 0, end; start < n; start = end) {
+		for (end = start; end < n && ops[end].k == ops[start].k; end++) {}
+		keys++;
+		int rc = check_key(ops + start, end - start, max_states);
+		if (rc == 1) {
+			bad++;
+			fprintf(stderr, "Key %u is not linearizable:\n", ops[start].k);
+			print_key(ops + start, end - start);
+		} else if (rc == 2) {
+			unknown++;
+			fprintf(stderr, "Key %u: gave up after %zu states\n", ops[start].k, max_states);
+		}
+	}
+
+	printf("Checked %d ops on %d keys: %d not linearizable, %d inconclusive\n", n, keys, bad, unknown);
+	free(ops);
+	return bad ? 1 : (unknown ? 2 : 0);
+}
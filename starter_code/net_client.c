@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "ring_buffer.h"
+#include "net_proto.h"
+#include "bench_util.h"
+
+/*
+ * Load generator for the socket front end of the server
+ * Replays the same workload files as client.c over a Unix domain socket or
+ * TCP, with one connection per thread and up to win_size pipelined requests
+ * per connection, and prints throughput in the same format as client.c
+*/
+
+#define MAX_THREADS 128
+#define LINE_LEN 256
+
+struct thread_context {
+	int tid;
+	int num_reqs;
+	struct net_request *reqs; /* requests assigned to this thread (wire format) */
+	struct net_response *res; /* corresponding responses */
+};
+
+char workload_file[256];
+char expected_file[256];
+char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+char host[64] = "127.0.0.1";
+int port = 0;
+int num_threads = 1;
+int win_size = 64;
+int validate = 0;
+int num_requests = 0;
+struct net_request *requests;
+struct net_response *results;
+pthread_t threads[MAX_THREADS];
+struct thread_context contexts[MAX_THREADS];
+
+/*
+ * Reads the workload file into the requests array (in wire format)
+ * Lines that are not valid single-key requests are ignored
+*/
+void read_input_file() {
+	struct buffer_descriptor *reqs;
+	num_requests = read_workload(workload_file, &reqs);
+	requests = malloc((num_requests > 0 ? num_requests : 1) * sizeof(struct net_request));
+	results = malloc((num_requests > 0 ? num_requests : 1) * sizeof(struct net_response));
+	if (requests == NULL || results == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < num_requests; i++) {
+		requests[i].req_type = reqs[i].req_type;
+		requests[i].k = htonl(reqs[i].k);
+		requests[i].v = htonl(reqs[i].v);
+		requests[i].old = htonl(reqs[i].old);
+	}
+	free(reqs);
+}
+
+int connect_server() {
+	int fd;
+	if (unix_path[0] != '\0') {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", unix_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+	} else {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		inet_pton(AF_INET, host, &addr.sin_addr);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+	}
+	perror("connect");
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Keeps up to win_size requests in flight on this thread's connection
+ * Each round sends every request the window allows in one write and reads
+ * back whatever responses have arrived
+*/
+void *thread_function(void *arg) {
+	struct thread_context *ctx = arg;
+	int fd = connect_server();
+	size_t sent = 0, recvd = 0; /* in bytes */
+	size_t total_out = ctx->num_reqs * sizeof(struct net_request);
+	size_t total_in = ctx->num_reqs * sizeof(struct net_response);
+
+	while (recvd < total_in) {
+		size_t inflight = sent / sizeof(struct net_request) - recvd / sizeof(struct net_response);
+		if (sent < total_out && inflight < (size_t)win_size) {
+			size_t len = (win_size - inflight) * sizeof(struct net_request);
+			if (len > total_out - sent)
+				len = total_out - sent;
+			ssize_t n = write(fd, (char *)ctx->reqs + sent, len);
+			if (n < 0) {
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+			sent += n;
+		}
+
+		ssize_t n = read(fd, (char *)ctx->res + recvd, total_in - recvd);
+		if (n <= 0) {
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+		recvd += n;
+	}
+	close(fd);
+	return NULL;
+}
+
+/* Same split as client.c - each thread submits an equal contiguous part */
+void start_threads() {
+	int reqs_per_th = num_requests / num_threads;
+	for (int i = 0; i < num_threads; i++) {
+		contexts[i].tid = i;
+		contexts[i].num_reqs = reqs_per_th;
+		contexts[i].reqs = requests + i * reqs_per_th;
+		contexts[i].res = results + i * reqs_per_th;
+		if (pthread_create(&threads[i], NULL, &thread_function, &contexts[i]))
+			perror("pthread_create");
+	}
+	for (int i = 0; i < num_threads; i++)
+		if (pthread_join(threads[i], NULL))
+			perror("pthread_join");
+}
+
+/*
+ * Check GET results against the solution file (nth line = nth GET)
+ * Only meaningful with a single thread, pipelining keeps the order
+ * @return 0 on success, 1 otherwise
+*/
+int check_results() {
+	FILE *f = fopen(expected_file, "r");
+	if (f == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	char line[LINE_LEN];
+	for (int i = 0; i < num_requests; i++) {
+		if (requests[i].req_type != GET)
+			continue;
+		if (fgets(line, LINE_LEN, f) == NULL)
+			break;
+		value_type exp = strtoul(line, NULL, 10);
+		if (ntohl(results[i].v) != exp) {
+			fprintf(stderr, "Get(%u) should return %u, but got %u\n",
+					ntohl(results[i].k), exp, ntohl(results[i].v));
+			fclose(f);
+			return 1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-h] [-u unix_socket | -p port [-H host]] [-n num_threads] [-w win_size] [-c] [-i workload] [-e solution]\n", name);
+	printf("-u path of the server's Unix domain socket\n");
+	printf("-p TCP port of the server (default host 127.0.0.1, see -H)\n");
+	printf("-n number of threads (one connection each)\n");
+	printf("-w max pipelined requests per connection (default 64)\n");
+	printf("-c check the result of get queries - only works with -n 1\n");
+	printf("-i input workload file name (default: workload.txt)\n");
+	printf("-e file name that contains the expected results for get queries (default: solution.txt)\n");
+}
+
+int main(int argc, char *argv[]) {
+	strcpy(workload_file, "workload.txt");
+	strcpy(expected_file, "solution.txt");
+
+	int op;
+	while ((op = getopt(argc, argv, "hu:p:H:n:w:ci:e:")) != -1) {
+		switch (op) {
+		case 'u':
+		if (strlen(optarg) >= sizeof(unix_path)) {
+			fprintf(stderr, "Socket path too long (max %zu characters): %s\n", sizeof(unix_path) - 1, optarg);
+			exit(EXIT_FAILURE);
+		}
+		snprintf(unix_path, sizeof(unix_path), "%s", optarg);
+		break;
+
+		case 'p':
+		port = atoi(optarg);
+		break;
+
+		case 'H':
+		strncpy(host, optarg, sizeof(host) - 1);
+		break;
+
+		case 'n':
+		num_threads = atoi(optarg);
+		break;
+
+		case 'w':
+		win_size = atoi(optarg);
+		break;
+
+		case 'c':
+		validate = 1;
+		break;
+
+		case 'i':
+		strncpy(workload_file, optarg, sizeof(workload_file) - 1);
+		break;
+
+		case 'e':
+		strncpy(expected_file, optarg, sizeof(expected_file) - 1);
+		break;
+
+		default:
+		usage(argv[0]);
+		exit(op == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if ((unix_path[0] == '\0' && port <= 0) || num_threads <= 0 ||
+			num_threads > MAX_THREADS || win_size <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	read_input_file();
+
+	struct timespec s, e;
+	clock_gettime(CLOCK_REALTIME, &s);
+	start_threads();
+	clock_gettime(CLOCK_REALTIME, &e);
+
+	int errors = 0;
+	for (int i = 0; i < num_requests / num_threads * num_threads; i++)
+		errors += results[i].status != NET_OK;
+	if (errors) {
+		fprintf(stderr, "%d requests rejected by the server\n", errors);
+		return 1;
+	}
+	if (validate && check_results() != 0)
+		return 1;
+
+	double ns = (e.tv_sec - s.tv_sec) * 1e9 + (e.tv_nsec - s.tv_nsec);
+	printf("Total time: %f ms\nThroughput: %f K/s\n", ns / 1e6, (num_requests * 1e6) / ns);
+	return 0;
+}
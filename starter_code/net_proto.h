@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include "common.h"
+
+/* Default TCP port of the socket front end */
+#define NET_DEFAULT_PORT 5370
+
+/* Wire format of the socket front end - fixed size records in network byte
+ * order. A connection can pipeline any number of requests without waiting;
+ * responses come back in request order and may be batched into one write */
+struct __attribute__((packed)) net_request {
+	uint8_t req_type; /* enum REQUEST_TYPE */
+	key_type k;
+	value_type v;
+	value_type old; /* CAS: expected value */
+};
+
+/* status of a response */
+enum NET_STATUS {
+	NET_OK = 0,
+	NET_BAD_REQUEST /* unknown req_type - nothing was applied */
+};
+
+struct __attribute__((packed)) net_response {
+	uint8_t status; /* enum NET_STATUS */
+	key_type k;
+	value_type v; /* GET result, or the value that was written for PUT */
+	value_type old; /* value before the request (INCR, CAS, GETSET) */
+};
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "kv_engine.h"
+#include "net_proto.h"
+#include "net_server.h"
+
+#define MAX_EVENTS 64
+#define LISTEN_BACKLOG 128
+/* Requests decoded per read - responses for a whole batch go out in one write */
+#define IN_BUF_REQS 512
+#define IN_BUF_SIZE (IN_BUF_REQS * sizeof(struct net_request))
+#define OUT_BUF_SIZE (IN_BUF_REQS * sizeof(struct net_response))
+/* Requests handed to the engine at once, see process_requests */
+#define NET_PREFETCH_GROUP 16
+
+struct net_conn {
+	int fd;
+	char in[IN_BUF_SIZE];
+	int in_len; /* bytes of in that hold (possibly partial) requests */
+	char out[OUT_BUF_SIZE];
+	int out_len; /* bytes of out waiting to be sent */
+	int out_off; /* bytes of out already sent */
+};
+
+static int epfd = -1;
+static int listen_fds[2] = { -1, -1 };
+static pthread_t net_tid;
+
+static int set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int listen_tcp(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, LISTEN_BACKLOG) < 0) {
+		perror("bind/listen (tcp)");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int listen_unix(const char *path) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long (max %zu characters): %s\n", sizeof(addr.sun_path) - 1, path);
+		close(fd);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, LISTEN_BACKLOG) < 0) {
+		perror("bind/listen (unix)");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void close_conn(struct net_conn *c) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c);
+}
+
+static void accept_conns(int lfd) {
+	while (1) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			return;
+
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		set_nonblocking(fd);
+
+		struct net_conn *c = calloc(1, sizeof(struct net_conn));
+		if (c == NULL) {
+			close(fd);
+			return;
+		}
+		c->fd = fd;
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+/*
+ * Send pending responses
+ * @return 1 if everything was sent, 0 if the socket is full, -1 on error
+*/
+static int flush_out(struct net_conn *c) {
+	while (c->out_off < c->out_len) {
+		ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		c->out_off += n;
+	}
+	c->out_len = c->out_off = 0;
+	return 1;
+}
+
+static int valid_req_type(uint8_t t) {
+	return t == PUT || t == GET || t == INCR || t == CAS || t == GETSET;
+}
+
+/*
+ * Apply every complete request in the input buffer and queue the responses
+ * Partial requests are kept for the next read
+*/
+static void process_batch(struct net_conn *c) {
+	int num_reqs = c->in_len / sizeof(struct net_request);
+	struct net_request *reqs = (struct net_request *)c->in;
+	struct net_response *resps = (struct net_response *)(c->out + c->out_len);
+	struct buffer_descriptor bds[NET_PREFETCH_GROUP];
+
+	/* In groups, so the engine can prefetch their slots together */
+	for (int i = 0; i < num_reqs; i += NET_PREFETCH_GROUP) {
+		int n = num_reqs - i < NET_PREFETCH_GROUP ? num_reqs - i : NET_PREFETCH_GROUP;
+		int bad[NET_PREFETCH_GROUP];
+		memset(bds, 0, n * sizeof(struct buffer_descriptor));
+		for (int j = 0; j < n; j++) {
+			bds[j].k = ntohl(reqs[i + j].k);
+			bds[j].v = ntohl(reqs[i + j].v);
+			bds[j].old = ntohl(reqs[i + j].old);
+			/* Only single-key requests fit the wire format - anything else
+			 * becomes a GET whose result is thrown away */
+			bad[j] = !valid_req_type(reqs[i + j].req_type);
+			bds[j].req_type = bad[j] ? GET : reqs[i + j].req_type;
+		}
+		process_requests(bds, n);
+		for (int j = 0; j < n; j++) {
+			resps[i + j].status = bad[j] ? NET_BAD_REQUEST : NET_OK;
+			resps[i + j].k = htonl(bds[j].k);
+			resps[i + j].v = bad[j] ? 0 : htonl(bds[j].v);
+			resps[i + j].old = bad[j] ? 0 : htonl(bds[j].old);
+		}
+	}
+	c->out_len += num_reqs * sizeof(struct net_response);
+
+	int used = num_reqs * sizeof(struct net_request);
+	memmove(c->in, c->in + used, c->in_len - used);
+	c->in_len -= used;
+}
+
+/*
+ * Read, process and answer requests until the socket is drained or the
+ * peer stops reading our responses (then we wait for EPOLLOUT)
+ * @return 0 to keep the connection, -1 to close it
+*/
+static int serve_conn(struct net_conn *c, uint32_t events) {
+	if (events & (EPOLLERR | EPOLLHUP))
+		return -1;
+
+	int rc = flush_out(c);
+	while (rc == 1) {
+		ssize_t n = read(c->fd, c->in + c->in_len, IN_BUF_SIZE - c->in_len);
+		if (n == 0)
+			return -1;
+		if (n < 0)
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+		c->in_len += n;
+		process_batch(c);
+		rc = flush_out(c);
+	}
+	if (rc < 0)
+		return -1;
+
+	/* Output is backed up - stop reading until the peer catches up */
+	struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = c };
+	epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	return 0;
+}
+
+static void *net_thread(void *arg) {
+	(void)arg;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (1) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.ptr == &listen_fds[0])
+				accept_conns(listen_fds[0]);
+			else if (events[i].data.ptr == &listen_fds[1])
+				accept_conns(listen_fds[1]);
+			else {
+				struct net_conn *c = events[i].data.ptr;
+				if (serve_conn(c, events[i].events) < 0) {
+					close_conn(c);
+				} else if ((events[i].events & EPOLLOUT) && c->out_len == 0) {
+					/* Caught up - go back to reading requests */
+					struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+					epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+int net_server_start(int tcp_port, const char *unix_path) {
+	epfd = epoll_create1(0);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	if (tcp_port > 0 && (listen_fds[0] = listen_tcp(tcp_port)) < 0)
+		return -1;
+	if (unix_path != NULL && (listen_fds[1] = listen_unix(unix_path)) < 0)
+		return -1;
+
+	for (int i = 0; i < 2; i++) {
+		if (listen_fds[i] < 0)
+			continue;
+		set_nonblocking(listen_fds[i]);
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_fds[i] };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fds[i], &ev) < 0) {
+			perror("epoll_ctl");
+			return -1;
+		}
+	}
+
+	if (pthread_create(&net_tid, NULL, net_thread, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
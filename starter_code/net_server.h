@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+ * Start the socket front end of the server: one epoll thread that serves
+ * every connection and feeds requests to process_request
+ * @param tcp_port TCP port to listen on (all interfaces), or 0 for none
+ * @param unix_path path of a Unix domain socket to listen on, or NULL for none
+ * @return 0 on success, -1 otherwise
+*/
+int net_server_start(int tcp_port, const char *unix_path);
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "ring_buffer.h"
+#include "bench_util.h"
+
+/*
+ * Bursty load against the server's worker pool
+ * Forks ./server with -n max_threads -m min_threads and replays a workload
+ * in bursts: each client thread issues burst requests back to back (one in
+ * flight, so every request is timed from submit to completion), then sleeps
+ * gap_ms. Prints latency percentiles and the CPU-seconds the server burned.
+ * Run it once with -m equal to -t (fixed pool) and once with a lower -m
+ * (elastic pool) to compare - `make bench-pool` does both.
+*/
+
+#define MAX_THREADS 128
+
+struct thread_context {
+	int tid;
+	int num_reqs;
+	struct buffer_descriptor *reqs;
+	struct buffer_descriptor *comp; /* this thread's window in the status board */
+	int comp_off;
+	double *lat_us; /* latency of each request */
+};
+
+char shm_file[] = "shmem_file";
+char workload_file[256] = "workload.txt";
+char *shmem_area;
+struct ring *ring;
+int num_threads = 4;
+int burst = 200;
+int gap_ms = 50;
+int s_max_threads = 4;
+int s_min_threads = 1;
+int s_table_size = 100000;
+int num_requests;
+struct buffer_descriptor *requests;
+double *latencies;
+pthread_t threads[MAX_THREADS];
+struct thread_context contexts[MAX_THREADS];
+
+pid_t start_server() {
+	int shm_size = sizeof(struct ring) + num_threads * sizeof(struct buffer_descriptor);
+	int fd = open(shm_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd < 0 || ftruncate(fd, shm_size) == -1) {
+		perror("shmem_file");
+		exit(EXIT_FAILURE);
+	}
+	shmem_area = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (shmem_area == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	memset(shmem_area, 0, shm_size);
+	ring = (struct ring *)shmem_area;
+	if (init_ring(ring) < 0)
+		exit(EXIT_FAILURE);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		char n[32], m[32], s[32];
+		sprintf(n, "-n %d", s_max_threads);
+		sprintf(m, "-m %d", s_min_threads);
+		sprintf(s, "-s %d", s_table_size);
+		execl("./server", "./server", n, m, s, (char *)NULL);
+		perror("execl");
+		exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+void *thread_function(void *arg) {
+	struct thread_context *ctx = arg;
+	for (int i = 0; i < ctx->num_reqs; i++) {
+		if (i > 0 && i % burst == 0)
+			usleep(gap_ms * 1000);
+
+		struct buffer_descriptor bd = ctx->reqs[i];
+		bd.res_off = ctx->comp_off;
+		double start = now_us();
+		ring_submit(ring, &bd);
+		while (__atomic_load_n(&ctx->comp->ready, __ATOMIC_ACQUIRE) != 1)
+			sched_yield();
+		ctx->lat_us[i] = now_us() - start;
+		ctx->comp->ready = 0;
+	}
+	return NULL;
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-i workload] [-n client_threads] [-b burst] [-g gap_ms] [-t server_max_threads] [-m server_min_threads] [-s table_size]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hi:n:b:g:t:m:s:")) != -1) {
+		switch (op) {
+		case 'i':
+		strncpy(workload_file, optarg, sizeof(workload_file) - 1);
+		break;
+
+		case 'n':
+		num_threads = atoi(optarg);
+		break;
+
+		case 'b':
+		burst = atoi(optarg);
+		break;
+
+		case 'g':
+		gap_ms = atoi(optarg);
+		break;
+
+		case 't':
+		s_max_threads = atoi(optarg);
+		break;
+
+		case 'm':
+		s_min_threads = atoi(optarg);
+		break;
+
+		case 's':
+		s_table_size = atoi(optarg);
+		break;
+
+		default:
+		usage(argv[0]);
+		exit(op == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (s_min_threads > s_max_threads)
+		s_min_threads = s_max_threads;
+	if (num_threads <= 0 || num_threads > MAX_THREADS || burst <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	num_requests = read_workload(workload_file, &requests);
+	latencies = malloc((num_requests > 0 ? num_requests : 1) * sizeof(double));
+	pid_t pid = start_server();
+
+	int reqs_per_th = num_requests / num_threads;
+	double start = now_us();
+	for (int i = 0; i < num_threads; i++) {
+		contexts[i].tid = i;
+		contexts[i].num_reqs = reqs_per_th;
+		contexts[i].reqs = requests + i * reqs_per_th;
+		contexts[i].lat_us = latencies + i * reqs_per_th;
+		contexts[i].comp_off = sizeof(struct ring) + i * sizeof(struct buffer_descriptor);
+		contexts[i].comp = (struct buffer_descriptor *)(shmem_area + contexts[i].comp_off);
+		if (pthread_create(&threads[i], NULL, thread_function, &contexts[i]))
+			perror("pthread_create");
+	}
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_us() - start;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	struct rusage ru;
+	getrusage(RUSAGE_CHILDREN, &ru);
+	double cpu_s = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+
+	int n = reqs_per_th * num_threads;
+	sort_samples(latencies, n);
+	printf("Server pool: %d-%d threads\n", s_min_threads, s_max_threads);
+	printf("Requests: %d in %.1f ms\n", n, elapsed / 1e3);
+	printf("Latency (us): p50 %.1f p99 %.1f max %.1f\n",
+			percentile(latencies, n, 0.5), percentile(latencies, n, 0.99), percentile(latencies, n, 1));
+	printf("Server CPU: %.3f s\n", cpu_s);
+	return 0;
+}
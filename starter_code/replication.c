@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "kv_engine.h"
+#include "replication.h"
+
+/* used - in binaries that never start replication (kv_bench, cache_test) LTO
+ * would otherwise fold it to NULL and warn about repl_publish's accesses */
+static struct repl_log *repl_log __attribute__((used));
+static int is_primary;
+static pthread_t heartbeat_tid;
+
+/* Standby replay statistics, printed at exit */
+static uint64_t replayed;
+static uint64_t lag_sum_ns;
+static uint64_t lag_max_ns;
+
+static struct repl_log *map_log(int create) {
+	/* A new file rather than truncating, a standby may still map the old one */
+	if (create)
+		unlink(REPL_FILE);
+	int fd = open(REPL_FILE, O_RDWR | (create ? O_CREAT | O_EXCL : 0), S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("open " REPL_FILE);
+		return NULL;
+	}
+	if (create && ftruncate(fd, sizeof(struct repl_log)) == -1) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	void *mem = mmap(NULL, sizeof(struct repl_log), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) {
+		perror("mmap " REPL_FILE);
+		return NULL;
+	}
+	return mem;
+}
+
+static void *heartbeat_thread(void *arg) {
+	(void)arg;
+	while (1) {
+		__atomic_fetch_add(&repl_log->heartbeat, 1, __ATOMIC_RELEASE);
+		usleep(REPL_HEARTBEAT_US);
+	}
+	return NULL;
+}
+
+int repl_start_primary(void) {
+	/* The new file is zero-filled - announce the log only once it's mapped */
+	repl_log = map_log(1);
+	if (repl_log == NULL)
+		return -1;
+	is_primary = 1;
+	__atomic_store_n(&repl_log->primary_pid, getpid(), __ATOMIC_RELEASE);
+
+	if (pthread_create(&heartbeat_tid, NULL, heartbeat_thread, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t repl_reserve(void) {
+	if (!is_primary)
+		return REPL_NONE;
+	return __atomic_fetch_add(&repl_log->head, 1, __ATOMIC_RELAXED);
+}
+
+void repl_publish(uint64_t pos, key_type k, value_type v, value_type old, uint32_t ttl_ms,
+		const struct buffer_descriptor *req) {
+	if (pos == REPL_NONE)
+		return;
+
+	/* Wait for the standby to free the slot - if it stops making progress it
+	 * is considered gone, and the log just overwrites from then on */
+	uint64_t waited_since = 0;
+	while (__atomic_load_n(&repl_log->standby_attached, __ATOMIC_ACQUIRE) &&
+			pos - __atomic_load_n(&repl_log->tail, __ATOMIC_ACQUIRE) >= REPL_LOG_SIZE) {
+		if (waited_since == 0)
+			waited_since = now_ns();
+		else if (now_ns() - waited_since > REPL_TIMEOUT_MS * 1000000ULL) {
+			fprintf(stderr, "Primary: standby stopped replaying, detaching it\n");
+			__atomic_store_n(&repl_log->standby_attached, 0, __ATOMIC_RELEASE);
+		}
+		sched_yield();
+	}
+
+	struct repl_entry *e = &repl_log->entries[pos % REPL_LOG_SIZE];
+	e->ts_ns = now_ns();
+	e->k = k;
+	e->v = v;
+	e->old = old;
+	e->ttl_ms = ttl_ms;
+	e->comp_off = req == NULL ? 0 : req->cq_off ? req->cq_off : req->res_off;
+	e->id = req == NULL ? 0 : req->id;
+	__atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void print_repl_stats(void) {
+	fprintf(stderr, "Standby: replayed %lu puts, lag avg %.1f us max %.1f us\n", replayed,
+			replayed ? lag_sum_ns / 1e3 / replayed : 0, lag_max_ns / 1e3);
+}
+
+/*
+ * Apply the entry at position pos if the primary finished writing it
+ * @return 1 if it was applied, 0 otherwise
+*/
+static int replay_entry(uint64_t pos) {
+	struct repl_entry *e = &repl_log->entries[pos % REPL_LOG_SIZE];
+	if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != pos + 1)
+		return 0;
+
+	struct buffer_descriptor bd;
+	memset(&bd, 0, sizeof(bd));
+	bd.req_type = PUT;
+	bd.k = e->k;
+	bd.v = e->v;
+	bd.ttl_ms = e->ttl_ms;
+	uint64_t lag = now_ns() - e->ts_ns;
+	process_request(&bd);
+
+	replayed++;
+	lag_sum_ns += lag;
+	if (lag > lag_max_ns)
+		lag_max_ns = lag;
+	return 1;
+}
+
+/*
+ * ring_recover callback - whether the dead primary applied a request it never
+ * acknowledged, going by the writes in the log tagged with it. Reads and
+ * requests without an id are served again
+ * @param bd the request, its result is filled in if it was applied
+ * @return 1 if every write of the request is in the log, 0 otherwise
+*/
+static int logged_request(struct buffer_descriptor *bd) {
+	if (bd->id == 0 || bd->req_type == GET || bd->req_type == MGET)
+		return 0;
+	int comp_off = bd->cq_off ? bd->cq_off : bd->res_off;
+	uint32_t writes = bd->req_type != MPUT ? 1 :
+		bd->batch_len < MAX_MULTI_KEYS ? bd->batch_len : MAX_MULTI_KEYS;
+	uint32_t found = 0;
+	uint64_t head = __atomic_load_n(&repl_log->head, __ATOMIC_ACQUIRE);
+	uint64_t pos = head > REPL_LOG_SIZE ? head - REPL_LOG_SIZE : 0;
+
+	for (; pos < head; pos++) {
+		struct repl_entry *e = &repl_log->entries[pos % REPL_LOG_SIZE];
+		if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != pos + 1 ||
+				e->comp_off != comp_off || e->id != bd->id)
+			continue;
+		found++;
+		bd->v = e->v;
+		if (bd->req_type != PUT && bd->req_type != MPUT)
+			bd->old = e->old;
+	}
+	/* A partly applied MPUT is served again - it only writes the same values */
+	if (found < writes)
+		return 0;
+	if (bd->req_type == MPUT)
+		bd->v = writes;
+	return 1;
+}
+
+int repl_follow(int primary_pid, struct ring *r) {
+	/* Wait for this run's primary to set up the log (the file may be stale) */
+	while ((repl_log = map_log(0)) == NULL ||
+			__atomic_load_n(&repl_log->primary_pid, __ATOMIC_ACQUIRE) != primary_pid) {
+		if (repl_log != NULL)
+			munmap(repl_log, sizeof(struct repl_log));
+		usleep(1000);
+	}
+	__atomic_store_n(&repl_log->standby_attached, 1, __ATOMIC_RELEASE);
+	atexit(print_repl_stats);
+
+	uint64_t tail = __atomic_load_n(&repl_log->tail, __ATOMIC_ACQUIRE);
+	uint64_t last_beat = __atomic_load_n(&repl_log->heartbeat, __ATOMIC_ACQUIRE);
+	uint64_t last_beat_ns = now_ns();
+	int idle = 0;
+
+	while (1) {
+		if (replay_entry(tail)) {
+			__atomic_store_n(&repl_log->tail, ++tail, __ATOMIC_RELEASE);
+			idle = 0;
+			continue;
+		}
+
+		uint64_t beat = __atomic_load_n(&repl_log->heartbeat, __ATOMIC_ACQUIRE);
+		if (beat != last_beat) {
+			last_beat = beat;
+			last_beat_ns = now_ns();
+		} else if (now_ns() - last_beat_ns > REPL_TIMEOUT_MS * 1000000ULL) {
+			break;
+		}
+		if (++idle > 64)
+			usleep(50);
+	}
+
+	/* Primary is gone - apply whatever it completed, skipping entries a dying
+	 * thread reserved but never finished */
+	uint64_t head = __atomic_load_n(&repl_log->head, __ATOMIC_ACQUIRE);
+	uint64_t lost = 0;
+	for (; tail < head; tail++)
+		if (!replay_entry(tail))
+			lost++;
+	__atomic_store_n(&repl_log->tail, tail, __ATOMIC_RELEASE);
+
+	uint32_t acked = r != NULL ? ring_recover(r, logged_request) : 0;
+	fprintf(stderr, "Standby: primary silent for %d ms, taking over after %.1f ms (%lu unfinished entries lost, %u applied requests acknowledged)\n",
+			REPL_TIMEOUT_MS, (now_ns() - last_beat_ns) / 1e6, lost, acked);
+	return 0;
+}
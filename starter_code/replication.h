@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include "common.h"
+#include "ring_buffer.h"
+
+/* Name of the shared memory file that holds the replication log */
+#define REPL_FILE "repl_file"
+/* Entries in the log ring - the primary stalls when the standby is this far behind */
+#define REPL_LOG_SIZE (1 << 16)
+#define REPL_HEARTBEAT_US 10000
+/* The standby takes over after this long without a primary heartbeat */
+#define REPL_TIMEOUT_MS 200
+
+/* One applied PUT - seq is set to position + 1 last, when the entry is complete */
+struct repl_entry {
+	uint64_t seq;
+	uint64_t ts_ns; /* CLOCK_MONOTONIC time the primary applied it */
+	key_type k;
+	value_type v;
+	value_type old; /* value before the write, returned by read-modify-writes */
+	uint32_t ttl_ms;
+	/* Request the write belongs to - its completion area (cq_off, or res_off
+	 * without one) and id. id 0 when it has none */
+	int comp_off;
+	uint32_t id;
+};
+
+/* Laid out at the beginning of REPL_FILE - written by the primary, replayed
+ * in order by the standby */
+struct __attribute__((aligned(64))) repl_log {
+	/* Next position to reserve (primary) */
+	uint64_t head;
+	char pad1[56];
+	/* Next position to replay (standby) */
+	uint64_t tail;
+	char pad2[56];
+	/* Bumped every REPL_HEARTBEAT_US by the primary */
+	uint64_t heartbeat;
+	/* Set last when the primary initialized the log */
+	int primary_pid;
+	/* While set, the primary waits for log space instead of overwriting */
+	int standby_attached;
+	struct repl_entry entries[REPL_LOG_SIZE];
+};
+
+/*
+ * Create REPL_FILE and start logging PUTs (primary, server -r)
+ * @return 0 on success, -1 otherwise
+*/
+int repl_start_primary(void);
+
+/* Position returned by repl_reserve when nothing is logged */
+#define REPL_NONE UINT64_MAX
+
+/*
+ * Reserve the log position of a PUT about to be applied - REPL_NONE unless
+ * repl_start_primary ran. Must be called while holding the lock of the entry
+ * that is written, so that same-key PUTs get positions in the order they were
+ * applied. Only a counter is bumped, the entry is written by repl_publish
+*/
+uint64_t repl_reserve(void);
+
+/*
+ * Write the entry at a position from repl_reserve - no-op for REPL_NONE
+ * Call it after dropping the entry lock: it may wait for the standby to free
+ * the slot. The standby replays positions in order, so it waits for this one
+ * @param old the value before the write
+ * @param req the ring request that made the write, NULL if none - lets a
+ * standby tell it was applied if the primary dies before acknowledging it
+*/
+void repl_publish(uint64_t pos, key_type k, value_type v, value_type old, uint32_t ttl_ms,
+		const struct buffer_descriptor *req);
+
+/*
+ * Follow the primary (standby, server -R primary_pid)
+ * Replays the log into the local store until the primary stops sending
+ * heartbeats, then repairs the ring so this process can serve it - requests
+ * the primary applied but never acknowledged are acknowledged from the log
+ * @return 0 once the standby should take over the ring, -1 on error
+*/
+int repl_follow(int primary_pid, struct ring *r);
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "common.h"
+#include "ring_buffer.h"
+#include "bench_util.h"
+
+/*
+ * Ring buffer microbenchmark - no server, no hash table
+ * Producer threads ring_submit a fixed number of items each while consumer
+ * threads drain them with ring_get, all in one process on a private ring.
+ * Every item carries its sequence number as the key, so consumers can time
+ * it from just before ring_submit to just after ring_get. Prints ops/sec,
+ * percentiles of the ring_submit call and of that end-to-end latency, and
+ * the cache misses of the run when perf_event_open is allowed.
+ * -b is the number of items a producer submits between yields and the
+ * number a consumer claims at a time, -a pins thread i to CPU i % nproc,
+ * -x alternates GETs and PUTs so both lanes are used.
+*/
+
+#define MAX_THREADS 64
+
+struct thread_context {
+	int tid;
+	int cpu; /* -1 when not pinned */
+};
+
+struct ring *ring;
+int producers = 1;
+int consumers = 1;
+int ops_per_producer = 1000000;
+int batch = 1;
+int pin = 0;
+int mixed = 0;
+uint64_t *submit_ns; /* by sequence number */
+double *submit_lat; /* by sequence number */
+double *e2e_lat; /* by sequence number */
+int64_t unclaimed; /* items no consumer claimed yet */
+pthread_t threads[MAX_THREADS];
+struct thread_context contexts[MAX_THREADS];
+
+void pin_thread(int cpu) {
+	if (cpu < 0)
+		return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		fprintf(stderr, "Could not pin a thread to cpu %d\n", cpu);
+}
+
+void *producer_function(void *arg) {
+	struct thread_context *ctx = arg;
+	struct buffer_descriptor bd;
+	pin_thread(ctx->cpu);
+
+	uint32_t seq = ctx->tid * ops_per_producer;
+	for (int i = 0; i < ops_per_producer; i++, seq++) {
+		memset(&bd, 0, sizeof(bd));
+		bd.req_type = mixed && (seq & 1) ? GET : PUT;
+		bd.k = seq;
+		bd.v = seq;
+		uint64_t start = now_ns();
+		submit_ns[seq] = start;
+		ring_submit(ring, &bd);
+		submit_lat[seq] = now_ns() - start;
+		if ((i + 1) % batch == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+void *consumer_function(void *arg) {
+	struct thread_context *ctx = arg;
+	struct buffer_descriptor bd;
+	pin_thread(ctx->cpu);
+
+	while (1) {
+		/* Claim up to batch items - ring_get can then block safely since
+		 * the producers are bound to deliver them */
+		int64_t left = __atomic_load_n(&unclaimed, __ATOMIC_RELAXED);
+		int64_t n;
+		do {
+			n = left < batch ? left : batch;
+		} while (n > 0 && !__atomic_compare_exchange_n(&unclaimed, &left, left - n, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		if (n <= 0)
+			break;
+
+		for (int64_t i = 0; i < n; i++) {
+			ring_get(ring, &bd);
+			e2e_lat[bd.k] = now_ns() - submit_ns[bd.k];
+			ring_complete(ring, &bd);
+			ring_release(ring, &bd);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Count cache misses of this process and of every thread it creates from now on
+ * @return the perf event fd, -1 if perf_event_open isn't available
+*/
+int open_cache_misses() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd >= 0)
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	return fd;
+}
+
+void print_percentiles(char *name, double *lat, int n) {
+	sort_samples(lat, n);
+	printf("%s latency (ns): p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f\n", name,
+			percentile(lat, n, 0.5), percentile(lat, n, 0.9), percentile(lat, n, 0.99),
+			percentile(lat, n, 0.999), percentile(lat, n, 1));
+}
+
+void usage(char *name) {
+	printf("Usage: %s [-p producers] [-c consumers] [-o ops_per_producer] [-b batch] [-a] [-x]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	int op;
+	while ((op = getopt(argc, argv, "hp:c:o:b:ax")) != -1) {
+		switch (op) {
+		case 'p':
+		producers = atoi(optarg);
+		break;
+
+		case 'c':
+		consumers = atoi(optarg);
+		break;
+
+		case 'o':
+		ops_per_producer = atoi(optarg);
+		break;
+
+		case 'b':
+		batch = atoi(optarg);
+		break;
+
+		case 'a':
+		pin = 1;
+		break;
+
+		case 'x':
+		mixed = 1;
+		break;
+
+		default:
+		usage(argv[0]);
+		exit(op == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (producers <= 0 || consumers <= 0 || producers + consumers > MAX_THREADS ||
+			ops_per_producer <= 0 || batch <= 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int total = producers * ops_per_producer;
+	ring = aligned_alloc(64, (sizeof(struct ring) + 63) & ~63UL);
+	submit_ns = malloc(total * sizeof(uint64_t));
+	submit_lat = malloc(total * sizeof(double));
+	e2e_lat = malloc(total * sizeof(double));
+	if (ring == NULL || submit_ns == NULL || submit_lat == NULL || e2e_lat == NULL) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memset(ring, 0, sizeof(struct ring));
+	if (init_ring(ring) < 0)
+		exit(EXIT_FAILURE);
+	/* Fault everything in before the clock starts */
+	memset(submit_ns, 0, total * sizeof(uint64_t));
+	memset(submit_lat, 0, total * sizeof(double));
+	memset(e2e_lat, 0, total * sizeof(double));
+	unclaimed = total;
+
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int perf_fd = open_cache_misses();
+	uint64_t start = now_ns();
+	for (int i = 0; i < producers + consumers; i++) {
+		int producer = i < producers;
+		contexts[i].tid = producer ? i : i - producers;
+		contexts[i].cpu = pin ? i % ncpu : -1;
+		if (pthread_create(&threads[i], NULL, producer ? producer_function : consumer_function, &contexts[i]))
+			perror("pthread_create");
+	}
+	for (int i = 0; i < producers + consumers; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_ns() - start;
+
+	uint64_t misses = 0;
+	int have_misses = perf_fd >= 0 && read(perf_fd, &misses, sizeof(misses)) == sizeof(misses);
+
+	printf("Ring: %d producers, %d consumers, batch %d%s%s\n", producers, consumers, batch,
+			pin ? ", pinned" : "", mixed ? ", get/put lanes" : "");
+	printf("Ops: %d in %.1f ms (%.2f M ops/s)\n", total, elapsed / 1e6, total * 1e3 / elapsed);
+	print_percentiles("Submit", submit_lat, total);
+	print_percentiles("End-to-end", e2e_lat, total);
+	if (have_misses)
+		printf("Cache misses: %lu (%.2f per op)\n", misses, (double)misses / total);
+	else
+		printf("Cache misses: n/a (perf_event_open not permitted)\n");
+	return 0;
+}
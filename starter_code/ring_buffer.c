@@ -1,9 +1,10 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "ring_buffer.h"
 
 // Indexing helpers
-int next(uint32_t curr) {
+uint32_t next(uint32_t curr) {
     if (curr > (RING_SIZE - 1)) {
         printf("next warning: curr went out of bounds\n");
     }
@@ -15,11 +16,11 @@ int next(uint32_t curr) {
     return curr;
 }
 
-int prev(uint32_t curr) {
-    if (curr < 0) {
+uint32_t prev(uint32_t curr) {
+    if (curr > (RING_SIZE - 1)) {
         printf("prev warning: curr went out of bounds\n");
     }
-    if (curr <= 0) {
+    if (curr == 0) {
         curr = (RING_SIZE - 1);
     } else {
         curr--;
@@ -27,40 +28,52 @@ int prev(uint32_t curr) {
     return curr;
 }
 
-/*
- * Initialize the ring
- * @param r A pointer to the ring
- * @return 0 on success, negative otherwise - this negative value will be
- * printed to output by the client program
-*/
-int init_ring(struct ring *r) {
+// Key slot used to keep same-key requests in one lane
+static uint32_t key_slot(key_type k) {
+    return k % LANE_KEY_SLOTS;
+}
+
+static int init_lane(struct lane *l) {
     // Heads are incremented immediately
-	r->c_tail = 0;
-	r->c_head = 0;
-    r->p_tail = 0;
-	r->p_head = 0;
+	l->c_tail = 0;
+	l->c_head = 0;
+    l->p_tail = 0;
+	l->p_head = 0;
     for (int i = 0; i < RING_SIZE; i++) {
-        r->buffer[i].k = 0;
-        r->buffer[i].v = 0;
-        r->buffer[i].ready = 0;
-        r->buffer[i].req_type = 0;
-        r->buffer[i].res_off = 0;
+        l->buffer[i].k = 0;
+        l->buffer[i].v = 0;
+        l->buffer[i].ready = 0;
+        l->buffer[i].req_type = 0;
+        l->buffer[i].res_off = 0;
+        l->buffer[i].lane = 0;
+        l->buffer[i].ttl_ms = 0;
+        l->buffer[i].old = 0;
+        l->buffer[i].t_submit = 0;
+        l->buffer[i].t_dequeue = 0;
+        l->buffer[i].t_applied = 0;
+        l->buffer[i].id = 0;
+        l->buffer[i].cq_off = 0;
+        l->buffer[i].batch_off = 0;
+        l->buffer[i].batch_len = 0;
+        l->buffer[i].slot = 0;
+        l->state[i] = RING_QUEUED;
     }
-    r->first_put = 1;
+    l->done_slot = 0;
+    l->done_progress = 0;
 
-    if (pthread_mutex_init(&r->c_head_lock, NULL) != 0) { 
+    if (pthread_mutex_init(&l->c_head_lock, NULL) != 0) { 
         printf("Could not initialize mutex lock\n"); 
         return -1;
     } 
-    if (pthread_mutex_init(&r->p_head_lock, NULL) != 0) { 
+    if (pthread_mutex_init(&l->p_head_lock, NULL) != 0) { 
         printf("Could not initialize mutex lock\n"); 
         return -1;
     } 
-    if (pthread_mutex_init(&r->c_tail_lock, NULL) != 0) { 
+    if (pthread_mutex_init(&l->c_tail_lock, NULL) != 0) { 
         printf("Could not initialize mutex lock\n"); 
         return -1;
     } 
-    if (pthread_mutex_init(&r->p_tail_lock, NULL) != 0) { 
+    if (pthread_mutex_init(&l->p_tail_lock, NULL) != 0) { 
         printf("Could not initialize mutex lock\n"); 
         return -1;
     } 
@@ -69,13 +82,26 @@ int init_ring(struct ring *r) {
 }
 
 /*
- * Submit a new item - should be thread-safe
- * This call will block the calling thread if there's not enough space
- * @param r The shared ring
- * @param bd A pointer to a valid buffer_descriptor - This pointer is only
- * guaranteed to be valid during the invocation of the function
+ * Initialize the ring
+ * @param r A pointer to the ring
+ * @return 0 on success, negative otherwise - this negative value will be
+ * printed to output by the client program
 */
-void ring_submit(struct ring *r, struct buffer_descriptor *bd) {
+int init_ring(struct ring *r) {
+    for (int i = 0; i < NUM_LANES; i++) {
+        if (init_lane(&r->lanes[i]) < 0)
+            return -1;
+        for (int j = 0; j < LANE_KEY_SLOTS; j++) {
+            r->queued[i][j] = 0;
+            r->completed[i][j] = 0;
+        }
+    }
+    r->split_lanes = 1;
+
+    return 0;
+}
+
+static void lane_submit(struct lane *l, struct buffer_descriptor *bd, int lane) {
     /**
      * "On both cores, ring->prod_head and ring->cons_tail are copied in 
      * local variables. The prod_next local variable points to the next 
@@ -83,56 +109,181 @@ void ring_submit(struct ring *r, struct buffer_descriptor *bd) {
      * enqueue."
      * https://doc.dpdk.org/guides/prog_guide/ring_lib.html
     */
-    
-    if (r->first_put) {
-        r->buffer[0].k = bd->k;
-        r->buffer[0].v = bd->v;
-        r->buffer[0].ready = bd->ready;
-        r->buffer[0].req_type = bd->req_type;
-        r->buffer[0].res_off = bd->res_off;
-        r->first_put = 0;
-        return;
-    }
 
-    printf("Put: Aquiring head lock...\n");
-    pthread_mutex_lock(&r->p_head_lock);
+    pthread_mutex_lock(&l->p_head_lock);
 
     // Block on full
-    while (next(r->p_head) == r->c_tail) {
-        printf("Put: Stalling for space at %i for buffer with key %i value %i\n", 
-            next(r->p_head), bd->k, bd->v);
-    };
+    while (next(l->p_head) == __atomic_load_n(&l->c_tail, __ATOMIC_ACQUIRE)) {};
     
-    r->p_head = next(r->p_head);
-    uint32_t p_ind = r->p_head;
+    l->p_head = next(l->p_head);
+    uint32_t p_ind = l->p_head;
 
-    pthread_mutex_unlock(&r->p_head_lock);
-    printf("Put: Unlocked next head at %i for buffer with key %i value %i\n", 
-        r->p_tail, bd->k, bd->v);
+    pthread_mutex_unlock(&l->p_head_lock);
+
+    // The slot may still say posted from its last lap - published below
+    __atomic_store_n(&l->state[p_ind], RING_QUEUED, __ATOMIC_RELAXED);
 
     // Deep copy bd to buffer at prod index
-    r->buffer[p_ind].k = bd->k;
-    r->buffer[p_ind].v = bd->v;
-    r->buffer[p_ind].ready = bd->ready;
-    r->buffer[p_ind].req_type = bd->req_type;
-    r->buffer[p_ind].res_off = bd->res_off;
+    l->buffer[p_ind].k = bd->k;
+    l->buffer[p_ind].v = bd->v;
+    l->buffer[p_ind].ready = bd->ready;
+    l->buffer[p_ind].req_type = bd->req_type;
+    l->buffer[p_ind].res_off = bd->res_off;
+    l->buffer[p_ind].lane = lane;
+    l->buffer[p_ind].ttl_ms = bd->ttl_ms;
+    l->buffer[p_ind].old = bd->old;
+    l->buffer[p_ind].t_submit = bd->t_submit;
+    l->buffer[p_ind].t_dequeue = bd->t_dequeue;
+    l->buffer[p_ind].t_applied = bd->t_applied;
+    l->buffer[p_ind].id = bd->id;
+    l->buffer[p_ind].cq_off = bd->cq_off;
+    l->buffer[p_ind].batch_off = bd->batch_off;
+    l->buffer[p_ind].batch_len = bd->batch_len;
 
     // Block until tail
-    while (next(r->p_tail) != p_ind) {
-        printf("Put: Stalling for tail turn at %i for buffer with key %i value %i\n", 
-        r->p_tail, bd->k, bd->v);
+    while (next(__atomic_load_n(&l->p_tail, __ATOMIC_ACQUIRE)) != p_ind) {}
+
+    pthread_mutex_lock(&l->p_tail_lock);
+
+    // Release publishes the copied descriptor to consumers
+    __atomic_store_n(&l->p_tail, next(l->p_tail), __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&l->p_tail_lock);
+}
+
+// Pairs of an MGET/MPUT - the ring sits at the start of the shared memory
+static struct kv_pair *multi_pairs(struct ring *r, struct buffer_descriptor *bd, uint32_t *n) {
+    *n = bd->batch_len < MAX_MULTI_KEYS ? bd->batch_len : MAX_MULTI_KEYS;
+    return (struct kv_pair *)((char *)r + bd->batch_off);
+}
+
+// Key slots a request holds in its lane, one per key - returns how many
+static uint32_t request_slots(struct ring *r, struct buffer_descriptor *bd, uint32_t *slots) {
+    if (bd->req_type != MGET && bd->req_type != MPUT) {
+        slots[0] = key_slot(bd->k);
+        return 1;
     }
+    uint32_t n;
+    struct kv_pair *pairs = multi_pairs(r, bd, &n);
+    for (uint32_t i = 0; i < n; i++)
+        slots[i] = key_slot(pairs[i].k);
+    return n;
+}
+
+// An MGET/MPUT touches many key slots, so it always goes to LANE_WRITE and
+// holds every one of them there - requests on those slots that are already
+// queued in LANE_READ must be applied before it is queued
+static void multi_submit(struct ring *r, struct buffer_descriptor *bd) {
+    uint32_t n;
+    struct kv_pair *pairs = multi_pairs(r, bd, &n);
+
+    // Taking the slots first makes later requests on them follow into LANE_WRITE
+    for (uint32_t i = 0; i < n; i++)
+        __atomic_fetch_add(&r->queued[LANE_WRITE][key_slot(pairs[i].k)], 1, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < n; i++)
+        while (ring_pending(r, LANE_READ, key_slot(pairs[i].k)) > 0) {}
+
+    lane_submit(&r->lanes[LANE_WRITE], bd, LANE_WRITE);
+}
+
+/*
+ * Submit a new item - should be thread-safe
+ * This call will block the calling thread if there's not enough space
+ * @param r The shared ring
+ * @param bd A pointer to a valid buffer_descriptor - This pointer is only
+ * guaranteed to be valid during the invocation of the function
+*/
+void ring_submit(struct ring *r, struct buffer_descriptor *bd) {
+    if (bd->req_type == MGET || bd->req_type == MPUT) {
+        multi_submit(r, bd);
+        return;
+    }
+
+    uint32_t slot = key_slot(bd->k);
+    int lane = LANE_WRITE;
+
+    if (r->split_lanes) {
+        // Follow a queued request on the same key slot into its lane. Both
+        // lanes are only pending while an MGET/MPUT waits in multi_submit for
+        // LANE_READ to drain - wait with it, then follow it into LANE_WRITE
+        uint32_t w;
+        while ((w = ring_pending(r, LANE_WRITE, slot)) > 0 && ring_pending(r, LANE_READ, slot) > 0) {}
+        if (w > 0)
+            lane = LANE_WRITE;
+        else if (ring_pending(r, LANE_READ, slot) > 0)
+            lane = LANE_READ;
+        else
+            lane = bd->req_type == GET ? LANE_READ : LANE_WRITE;
+    }
+
+    __atomic_fetch_add(&r->queued[lane][slot], 1, __ATOMIC_RELEASE);
+    lane_submit(&r->lanes[lane], bd, lane);
+}
+
+// Copy out a claimed slot - it stays taken until ring_release
+static void consume_slot(struct lane *l, uint32_t c_ind, struct buffer_descriptor *bd) {
+    // Deep copy bd to buffer at prod index
+    bd->k = l->buffer[c_ind].k;
+    bd->v = l->buffer[c_ind].v;
+    bd->ready = l->buffer[c_ind].ready;
+    bd->req_type = l->buffer[c_ind].req_type;
+    bd->res_off = l->buffer[c_ind].res_off;
+    bd->lane = l->buffer[c_ind].lane;
+    bd->ttl_ms = l->buffer[c_ind].ttl_ms;
+    bd->old = l->buffer[c_ind].old;
+    bd->t_submit = l->buffer[c_ind].t_submit;
+    bd->t_dequeue = l->buffer[c_ind].t_dequeue;
+    bd->t_applied = l->buffer[c_ind].t_applied;
+    bd->id = l->buffer[c_ind].id;
+    bd->cq_off = l->buffer[c_ind].cq_off;
+    bd->batch_off = l->buffer[c_ind].batch_off;
+    bd->batch_len = l->buffer[c_ind].batch_len;
+    bd->slot = c_ind;
+}
+
+/*
+ * Get an item from the ring without blocking on empty - should be thread-safe
+ * @param r A pointer to the shared ring
+ * @param lane the lane to take the item from
+ * @param bd pointer to a valid buffer_descriptor to copy the data to
+ * @return 0 if an item was copied to bd, -1 if the lane was empty
+*/
+int ring_try_get_lane(struct ring *r, int lane, struct buffer_descriptor *bd) {
+    struct lane *l = &r->lanes[lane];
+
+    pthread_mutex_lock(&l->c_head_lock);
 
-    printf("Put: Aquiring tail lock at %i for buffer with key %i value %i\n", 
-        r->p_tail, bd->k, bd->v);
-    pthread_mutex_lock(&r->p_tail_lock);
+    // Posted slots ahead of c_head were finished before a ring_recover
+    uint32_t c_ind = l->c_head;
+    do {
+        if (c_ind == __atomic_load_n(&l->p_tail, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_unlock(&l->c_head_lock);
+            return -1;
+        }
+        c_ind = next(c_ind);
+        // Release lets lane_release trust the states of slots up to c_head
+        __atomic_store_n(&l->c_head, c_ind, __ATOMIC_RELEASE);
+    } while (__atomic_load_n(&l->state[c_ind], __ATOMIC_ACQUIRE) == RING_POSTED);
 
-    r->p_tail = next(r->p_tail);
+    pthread_mutex_unlock(&l->c_head_lock);
 
-    pthread_mutex_unlock(&r->p_tail_lock);
-    printf("Put: Incremented tail to %i for buffer with key %i value %i\n", 
-        r->p_tail, bd->k, bd->v);
+    consume_slot(l, c_ind, bd);
+    return 0;
+}
 
+/*
+ * Get an item from the ring without blocking on empty - should be thread-safe
+ * Lanes are tried in priority order (LANE_READ first)
+ * @param r A pointer to the shared ring
+ * @param bd pointer to a valid buffer_descriptor to copy the data to
+ * @return 0 if an item was copied to bd, -1 if the ring was empty
+*/
+int ring_try_get(struct ring *r, struct buffer_descriptor *bd) {
+    for (int i = 0; i < NUM_LANES; i++) {
+        if (ring_try_get_lane(r, i, bd) == 0)
+            return 0;
+    }
+    return -1;
 }
 
 /*
@@ -144,44 +295,269 @@ void ring_submit(struct ring *r, struct buffer_descriptor *bd) {
  * the signature.
 */
 void ring_get(struct ring *r, struct buffer_descriptor *bd) {
+    // Block on empty
+    while (ring_try_get(r, bd) < 0) {};
+}
 
-    printf("Get: Aquiring head lock for buffer with key %i value %i\n", bd->k, bd->v);
-    pthread_mutex_lock(&r->c_head_lock);
+// Count a request's keys as completed, from its key index first on - the
+// caller holds c_tail_lock. The lane journals each step, so that ring_recover
+// can finish the count of a consumer that died halfway through
+static void complete_slots(struct ring *r, struct buffer_descriptor *bd, uint32_t first) {
+    struct lane *l = &r->lanes[bd->lane];
+    uint32_t slots[MAX_MULTI_KEYS];
+    uint32_t n = request_slots(r, bd, slots);
 
-    // Block on empty
-    while (r->c_head == r->p_tail) {
-        printf("Get: Stalling for new value at %i for buffer with key %i value %i\n", 
-            next(r->c_head), bd->k, bd->v);
-    };
+    l->done_slot = bd->slot;
+    for (uint32_t i = first; i < n; i++) {
+        uint32_t *completed = &r->completed[bd->lane][slots[i]];
+        uint32_t before = __atomic_load_n(completed, __ATOMIC_RELAXED);
+        __atomic_store_n(&l->done_progress, (uint64_t)(i + 1) << 32 | before, __ATOMIC_RELEASE);
+        __atomic_store_n(completed, before + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&l->state[bd->slot], RING_COMPLETED, __ATOMIC_RELEASE);
+    __atomic_store_n(&l->done_progress, 0, __ATOMIC_RELEASE);
+}
 
-    r->c_head = next(r->c_head);
-    uint32_t c_ind = r->c_head;
+/*
+ * Mark an item as applied - must be called once per item taken from the ring,
+ * after the request took effect and before its completion is posted. An item
+ * ring_recover served again may be completed already, and is only counted once
+ * @param r A pointer to the shared ring
+ * @param bd the item as returned by one of the get functions
+*/
+void ring_complete(struct ring *r, struct buffer_descriptor *bd) {
+    struct lane *l = &r->lanes[bd->lane];
+    pthread_mutex_lock(&l->c_tail_lock);
+    if (__atomic_load_n(&l->state[bd->slot], __ATOMIC_ACQUIRE) != RING_COMPLETED)
+        complete_slots(r, bd, 0);
+    pthread_mutex_unlock(&l->c_tail_lock);
+}
 
-    pthread_mutex_unlock(&r->c_head_lock);
-    printf("Get: Unlocked next head at %i for buffer with key %i value %i\n", 
-        c_ind, bd->k, bd->v);
+/*
+ * Post the completion of an applied item to the client - to its completion
+ * queue (cq_off) or its status board slot (res_off)
+ * @param r A pointer to the shared ring, at the start of the shared region
+ * @param bd the completed item
+*/
+void ring_post(struct ring *r, struct buffer_descriptor *bd) {
+    char *shared_mem_start = (char *)r;
+    if (bd->cq_off) {
+        cq_post((struct completion_queue *)(shared_mem_start + bd->cq_off), bd);
+        return;
+    }
+    struct buffer_descriptor *result = (struct buffer_descriptor *)(shared_mem_start + bd->res_off);
+    struct buffer_descriptor copy = *bd;
+    // A slot holding the id but not ready yet tells a standby the copy may be
+    // torn - clear ready before the id can show up
+    copy.ready = 0;
+    __atomic_store_n(&result->ready, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(result, &copy, sizeof(struct buffer_descriptor));
+    __atomic_store_n(&result->ready, 1, __ATOMIC_RELEASE);
+}
 
-    // Deep copy bd to buffer at prod index
-    bd->k = r->buffer[c_ind].k;
-    bd->v = r->buffer[c_ind].v;
-    bd->ready = r->buffer[c_ind].ready;
-    bd->req_type = r->buffer[c_ind].req_type;
-    bd->res_off = r->buffer[c_ind].res_off;
+// Move c_tail over the posted slots right after it - only up to c_head, past
+// it a slot may still say posted from its last lap. Producers reset the state
+// when they take a slot again
+static void lane_release(struct lane *l) {
+    pthread_mutex_lock(&l->c_tail_lock);
 
-    // Block until tail
-    while (next(r->c_tail) != c_ind) {
-        printf("Get: Stalling for tail turn at %i for buffer with key %i value %i\n", 
-            c_ind, bd->k, bd->v);
+    uint32_t t;
+    while (l->c_tail != __atomic_load_n(&l->c_head, __ATOMIC_ACQUIRE) &&
+           __atomic_load_n(&l->state[t = next(l->c_tail)], __ATOMIC_ACQUIRE) == RING_POSTED)
+        __atomic_store_n(&l->c_tail, t, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&l->c_tail_lock);
+}
+
+/*
+ * Hand an item's slot back to producers - must be called once per item taken
+ * from the ring, after its completion was posted
+ * @param r A pointer to the shared ring
+ * @param bd the item as returned by one of the get functions
+*/
+void ring_release(struct ring *r, struct buffer_descriptor *bd) {
+    struct lane *l = &r->lanes[bd->lane];
+    // Set before taking the lock - whoever holds it then either sees the state
+    // or leaves the lock to this call, which does
+    __atomic_store_n(&l->state[bd->slot], RING_POSTED, __ATOMIC_RELEASE);
+    lane_release(l);
+}
+
+/*
+ * Backlog of a single lane, see ring_count
+*/
+uint32_t ring_lane_count(struct ring *r, int lane) {
+    uint32_t p_tail = __atomic_load_n(&r->lanes[lane].p_tail, __ATOMIC_RELAXED);
+    uint32_t c_head = __atomic_load_n(&r->lanes[lane].c_head, __ATOMIC_RELAXED);
+    return (p_tail + RING_SIZE - c_head) % RING_SIZE;
+}
+
+/*
+ * Number of submitted items that no consumer has claimed yet (ring backlog)
+ * Only a snapshot - producers and consumers may move it concurrently
+*/
+uint32_t ring_count(struct ring *r) {
+    uint32_t count = 0;
+    for (int i = 0; i < NUM_LANES; i++)
+        count += ring_lane_count(r, i);
+    return count;
+}
+
+// Whether the completion of a claimed item reached its client - the
+// completion area holds it, or a later request's of the same area. Holes in
+// a completion queue must have been repaired first (cq_repair), so that no
+// torn entry is left to match
+static int ring_posted(struct ring *r, struct buffer_descriptor *bd) {
+    char *shared_mem_start = (char *)r;
+    if (bd->id == 0)
+        return 0;
+    if (bd->cq_off) {
+        struct completion_queue *q = (struct completion_queue *)(shared_mem_start + bd->cq_off);
+        for (uint32_t i = 0; i <= q->mask; i++) {
+            if (__atomic_load_n(&q->entries[i].seq, __ATOMIC_ACQUIRE) != 0 && q->entries[i].bd.id == bd->id)
+                return 1;
+        }
+        return 0;
     }
+    struct buffer_descriptor *result = (struct buffer_descriptor *)(shared_mem_start + bd->res_off);
+    uint32_t id = __atomic_load_n(&result->id, __ATOMIC_ACQUIRE);
+    // The same id without ready is a copy the poster didn't finish
+    if (id == bd->id)
+        return __atomic_load_n(&result->ready, __ATOMIC_ACQUIRE) != 0;
+    return id > bd->id;
+}
 
-    printf("Get: Aquiring tail lock at %i for buffer with key %i value %i\n", 
-        c_ind, bd->k, bd->v);
-    pthread_mutex_lock(&r->c_tail_lock);
+// Finish the count of a ring_complete the lane's consumer died in, from the
+// key it journaled on - run before any of the lane's items is looked at
+static void repair_complete(struct ring *r, int lane) {
+    struct lane *l = &r->lanes[lane];
+    uint64_t progress = l->done_progress;
+    if (progress == 0)
+        return;
+    if (l->state[l->done_slot] != RING_COMPLETED) {
+        struct buffer_descriptor bd;
+        uint32_t slots[MAX_MULTI_KEYS];
+        uint32_t i = (progress >> 32) - 1;
+        consume_slot(l, l->done_slot, &bd);
+        request_slots(r, &bd, slots);
+        // The key it died on is counted if its count moved past before
+        if (r->completed[lane][slots[i]] != (uint32_t)progress)
+            i++;
+        complete_slots(r, &bd, i);
+    }
+    l->done_progress = 0;
+}
 
-    r->c_tail = next(r->c_tail);
+/*
+ * Reset the consumer side after the consumer process died - only safe while
+ * no other consumer is running
+ * A ring_complete a dead consumer was in is finished first. Of the slots the
+ * dead consumers had claimed but not released, the ones whose completion was
+ * posted are released. The others are finished here if applied says so, and
+ * handed out again otherwise - they can't have been overwritten yet. Every step goes by the slot states, so running it again
+ * after a standby died in it is safe. Consumer locks the dead may have held
+ * are reinitialized
+ * @param r A pointer to the shared ring
+ * @param applied see ring_buffer.h
+ * @return the number of items finished here
+*/
+uint32_t ring_recover(struct ring *r, int (*applied)(struct buffer_descriptor *bd)) {
+    uint32_t finished = 0;
+    for (int i = 0; i < NUM_LANES; i++) {
+        struct lane *l = &r->lanes[i];
+        pthread_mutex_init(&l->c_head_lock, NULL);
+        pthread_mutex_init(&l->c_tail_lock, NULL);
+        repair_complete(r, i);
 
-    pthread_mutex_unlock(&r->c_tail_lock);
-    printf("Get: Incremented tail to %i for buffer with key %i value %i\n", 
-        r->c_tail, bd->k, bd->v);
-    
+        uint32_t end = next(l->c_head);
+        for (uint32_t t = next(l->c_tail); t != end; t = next(t)) {
+            if (l->state[t] == RING_POSTED)
+                continue;
+            struct buffer_descriptor bd;
+            consume_slot(l, t, &bd);
+            if (bd.cq_off)
+                cq_repair((struct completion_queue *)((char *)r + bd.cq_off));
+            if (ring_posted(r, &bd)) {
+                ring_complete(r, &bd);
+            } else if (applied != NULL && applied(&bd)) {
+                ring_complete(r, &bd);
+                ring_post(r, &bd);
+                finished++;
+            } else {
+                continue;
+            }
+            __atomic_store_n(&l->state[t], RING_POSTED, __ATOMIC_RELEASE);
+        }
+        lane_release(l);
+        __atomic_store_n(&l->c_head, __atomic_load_n(&l->c_tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    }
+    return finished;
+}
+
+/*
+ * Bytes taken by a completion queue with room for entries completions
+*/
+size_t cq_bytes(uint32_t entries) {
+    return sizeof(struct completion_queue) + cq_entries(entries) * sizeof(struct cq_entry);
+}
+
+/*
+ * Initialize an (already zeroed) completion queue
+ * @param entries capacity, rounded up to a power of two
+*/
+void cq_init(struct completion_queue *q, uint32_t entries) {
+    q->mask = cq_entries(entries) - 1;
+    q->reserve = 0;
+}
+
+/*
+ * Post a completion - safe with any number of concurrent posters
+ * Never waits: the owner has at most as many requests in flight as the queue
+ * holds, and reaps an entry before it submits the next request
+*/
+void cq_post(struct completion_queue *q, struct buffer_descriptor *bd) {
+    uint32_t pos = __atomic_fetch_add(&q->reserve, 1, __ATOMIC_RELAXED);
+    struct cq_entry *e = &q->entries[pos & q->mask];
+    memcpy(&e->bd, bd, sizeof(struct buffer_descriptor));
+    // Release publishes the copied descriptor to the reaper
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Fill the holes of posters that died after reserving their entry - each
+ * gets an entry of id 0 - so that the reaper gets past them. Only safe while
+ * no other poster is running
+*/
+void cq_repair(struct completion_queue *q) {
+    uint32_t reserve = __atomic_load_n(&q->reserve, __ATOMIC_ACQUIRE);
+    // Only the last mask + 1 positions can still be waiting to be reaped
+    uint32_t pos = reserve > q->mask ? reserve - q->mask - 1 : 0;
+    for (; pos != reserve; pos++) {
+        struct cq_entry *e = &q->entries[pos & q->mask];
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) == pos + 1)
+            continue;
+        memset(&e->bd, 0, sizeof(struct buffer_descriptor));
+        __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Take every completion posted so far, up to max, in posting order
+ * Single consumer only - the owner keeps its position in *head
+ * @return the number of completions copied to out
+*/
+int cq_reap(struct completion_queue *q, uint32_t *head, struct buffer_descriptor *out, int max) {
+    int n = 0;
+    uint32_t pos = *head;
+    while (n < max) {
+        struct cq_entry *e = &q->entries[pos & q->mask];
+        // An entry is valid once its seq says it was posted at pos
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        memcpy(&out[n++], &e->bd, sizeof(struct buffer_descriptor));
+        pos++;
+    }
+    *head = pos;
+    return n;
 }
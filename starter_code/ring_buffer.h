@@ -6,9 +6,37 @@
 
 #define RING_SIZE 1024
 
+/* Submission lanes - GETs and PUTs are queued separately so a burst of PUTs
+ * doesn't delay GETs; the server picks between lanes by weight */
+enum LANE {
+  LANE_READ = 0,
+  LANE_WRITE,
+  NUM_LANES
+};
+
+/* Key slots tracked for same-key ordering across lanes */
+#define LANE_KEY_SLOTS 1024
+
+/* INCR, CAS and GETSET are read-modify-writes applied atomically by the
+ * server - see the v and old fields of buffer_descriptor */
 enum REQUEST_TYPE {
   PUT = 0,
-  GET
+  GET,
+  INCR,   /* add v to the value (a missing key counts as 0) */
+  CAS,    /* set the value to v if it currently is old */
+  GETSET, /* set the value to v */
+  MGET,   /* get every key of the batch array, see batch_off */
+  MPUT    /* put every pair of the batch array */
+};
+
+/* Most keys a single MGET/MPUT carries */
+#define MAX_MULTI_KEYS 64
+
+/* Element of the batch array of an MGET/MPUT - MGET only reads k and
+ * stores the key's value in v */
+struct kv_pair {
+	key_type k;
+	value_type v;
 };
 
 /* Client sends requests using this format - Each element of the ring is 
@@ -31,11 +59,77 @@ struct buffer_descriptor {
 	 * The client program will reset the flag to 0 before using the same 
 	 * location for completion */
   	int ready;
+/* ready of a status board slot whose completion the client took - tells a
+ * standby that the completion was posted (see ring_recover) */
+#define RESULT_TAKEN 2
+	/* Lane the request was queued in - set by ring_submit */
+	int lane;
+	/* PUT in cache mode: lifetime of the entry in ms, 0 for the server default */
+	uint32_t ttl_ms;
+	/* Read-modify-writes: CAS takes the expected value here - on completion
+	 * old holds the value before the op and v the value after it (a CAS
+	 * succeeded iff the returned old equals the expected value) */
+	value_type old;
+	/* Trace mode (client -T): now_ns() stamps of a sampled request at submit,
+	 * at dequeue by a server worker and after the table op - all 0 when the
+	 * request isn't sampled */
+	uint64_t t_submit;
+	uint64_t t_dequeue;
+	uint64_t t_applied;
+	/* The client's tag for the request - nonzero and growing with every
+	 * request of a completion area, so that after a failover the standby can
+	 * tell which completions were posted. Completion queue mode (client -q)
+	 * also needs the byte offset of the completion_queue the server posts it
+	 * to - 0 means the completion goes to res_off as described above */
+	uint32_t id;
+	int cq_off;
+	/* MGET/MPUT: byte offset of an array of batch_len kv_pairs in the shared
+	 * region, owned by the client until the request completes - the
+	 * completion returns the number of keys applied in v */
+	int batch_off;
+	uint32_t batch_len;
+	/* Ring slot the request was taken from - set by the get functions for
+	 * ring_release */
+	uint32_t slot;
 };
 
-/* This structure is laid out at the beginning of the shared memory region
- * You can add new fields to the structure (It's very unlikely that you need to) */
-struct __attribute__((packed, aligned(64))) ring {
+/* One posted completion - seq is the queue position it was posted at plus 1,
+ * so the reaper can tell a fresh entry from the one a lap behind */
+struct cq_entry {
+	uint32_t seq;
+	struct buffer_descriptor bd;
+};
+
+/* Per client thread completion queue - the server appends completed
+ * descriptors in whatever order it finishes them, the client reaps everything
+ * posted so far at once instead of polling a ready flag per request */
+struct __attribute__((packed, aligned(64))) completion_queue {
+	/* Next position to post at - claimed by posters with a fetch_add */
+	uint32_t reserve;
+	/* Capacity - 1 (the capacity is a power of two) */
+	uint32_t mask;
+	char pad[56];
+	struct cq_entry entries[];
+};
+
+/* Capacity of a completion queue asked to hold n completions */
+static inline uint32_t cq_entries(uint32_t n) {
+	uint32_t entries = 1;
+	while (entries < n)
+		entries <<= 1;
+	return entries;
+}
+
+/* Progress of the request in a ring slot - reset to RING_QUEUED when a
+ * producer takes the slot */
+enum RING_STATE {
+  RING_QUEUED = 0,
+  RING_COMPLETED, /* ring_complete counted it */
+  RING_POSTED     /* its completion reached the client */
+};
+
+/* One FIFO lane of the ring */
+struct __attribute__((packed, aligned(64))) lane {
 	/* Producer tail - where the last valid item is */
 	uint32_t p_tail; 
 	char pad1[60];
@@ -47,19 +141,48 @@ struct __attribute__((packed, aligned(64))) ring {
 	/* Consumer tail - first item to be consumed - producers can't write
 	 * any data here - producers can only write before c_tail */
 	uint32_t c_tail;
-	char pad3[60];
+	/* ring_complete of the item in done_slot in progress, for ring_recover:
+	 * 0, or (key index + 1) << 32 | the key slot's completed count before
+	 * that key was counted - written under c_tail_lock */
+	uint32_t done_slot;
+	uint64_t done_progress;
+	char pad3[48];
 	/* Consumer head - next consumer will consume the data pointed by c_head */
 	uint32_t c_head;
 	char pad4[60];
 	/* An array of structs - This is the actual ring */
 	struct buffer_descriptor buffer[RING_SIZE];
+	/* enum RING_STATE of each slot - c_tail only moves past posted slots,
+	 * so a request stays in the ring until its completion is posted */
+	uint8_t state[RING_SIZE];
 	pthread_mutex_t p_head_lock;
 	pthread_mutex_t c_head_lock;
 	pthread_mutex_t p_tail_lock;
 	pthread_mutex_t c_tail_lock;
-	int first_put;
 };
 
+/* This structure is laid out at the beginning of the shared memory region
+ * You can add new fields to the structure (It's very unlikely that you need to) */
+struct __attribute__((packed, aligned(64))) ring {
+	struct lane lanes[NUM_LANES];
+	/* Requests per lane and key slot, queued by producers and completed by
+	 * consumers - the difference (ring_pending) is what is still pending. A
+	 * request goes to another lane instead of its own while that lane holds a
+	 * request on the same key slot, so a client's same-key requests stay in
+	 * order. An MGET/MPUT counts once for each of its keys. Each counter has
+	 * one side writing it, which lets ring_recover repair completed exactly */
+	uint32_t queued[NUM_LANES][LANE_KEY_SLOTS];
+	uint32_t completed[NUM_LANES][LANE_KEY_SLOTS];
+	/* If 0, every request goes to LANE_WRITE (a single FIFO, for comparison) */
+	int split_lanes;
+};
+
+/* Requests of a lane on a key slot that were queued and not completed yet */
+static inline uint32_t ring_pending(struct ring *r, int lane, uint32_t slot) {
+	return __atomic_load_n(&r->queued[lane][slot], __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->completed[lane][slot], __ATOMIC_ACQUIRE);
+}
+
 /*
  * Initialize the ring
  * @param r A pointer to the ring
@@ -85,4 +208,107 @@ void ring_submit(struct ring *r, struct buffer_descriptor *bd);
  * Note: This function is not used in the clinet program, so you can change
  * the signature.
 */
-void ring_get(struct ring *r, struct buffer_descriptor *bd); 
+void ring_get(struct ring *r, struct buffer_descriptor *bd);
+
+/*
+ * Get an item from the ring without blocking on empty - should be thread-safe
+ * @param r A pointer to the shared ring
+ * @param bd pointer to a valid buffer_descriptor to copy the data to
+ * @return 0 if an item was copied to bd, -1 if the ring was empty
+*/
+int ring_try_get(struct ring *r, struct buffer_descriptor *bd);
+
+/*
+ * Get an item from one lane without blocking on empty - should be thread-safe
+ * @param r A pointer to the shared ring
+ * @param lane the lane to take the item from
+ * @param bd pointer to a valid buffer_descriptor to copy the data to
+ * @return 0 if an item was copied to bd, -1 if the lane was empty
+*/
+int ring_try_get_lane(struct ring *r, int lane, struct buffer_descriptor *bd);
+
+/*
+ * Mark an item as applied - must be called once per item taken from the ring,
+ * after the request took effect and before its completion is posted
+ * @param r A pointer to the shared ring
+ * @param bd the item as returned by one of the get functions
+*/
+void ring_complete(struct ring *r, struct buffer_descriptor *bd);
+
+/*
+ * Post the completion of an applied item to the client - to its completion
+ * queue (cq_off) or its status board slot (res_off)
+ * @param r A pointer to the shared ring, at the start of the shared region
+ * @param bd the completed item
+*/
+void ring_post(struct ring *r, struct buffer_descriptor *bd);
+
+/*
+ * Hand an item's slot back to producers - must be called once per item taken
+ * from the ring, after its completion was posted. Slots go back in ring
+ * order, so a slot may wait for slower items claimed before it
+ * @param r A pointer to the shared ring
+ * @param bd the item as returned by one of the get functions
+*/
+void ring_release(struct ring *r, struct buffer_descriptor *bd);
+
+/*
+ * Number of submitted items that no consumer has claimed yet (ring backlog)
+ * Only a snapshot - producers and consumers may move it concurrently
+*/
+uint32_t ring_count(struct ring *r);
+
+/*
+ * Backlog of a single lane, see ring_count
+*/
+uint32_t ring_lane_count(struct ring *r, int lane);
+
+/*
+ * Reset the consumer side after the consumer process died - only safe while
+ * no other consumer is running. Items the dead consumers claimed but never
+ * posted a completion for are either finished here or served again, a
+ * ring_complete cut short is finished, and holes that dying posters left in
+ * completion queues are filled with entries of id 0
+ * @param r A pointer to the shared ring
+ * @param applied tells whether a claimed item already took effect, filling
+ * in its result if so - its completion is then posted instead of serving it
+ * again. NULL if nothing can have been applied without being posted
+ * @return the number of items finished here
+*/
+uint32_t ring_recover(struct ring *r, int (*applied)(struct buffer_descriptor *bd));
+
+/*
+ * Bytes taken by a completion queue with room for entries completions
+*/
+size_t cq_bytes(uint32_t entries);
+
+/*
+ * Initialize an (already zeroed) completion queue
+ * @param q the queue, somewhere in the shared region
+ * @param entries capacity - at least the owner's window, rounded up to a
+ * power of two
+*/
+void cq_init(struct completion_queue *q, uint32_t entries);
+
+/*
+ * Post a completion - should be thread-safe, never blocks
+ * @param q the queue named by bd->cq_off
+ * @param bd the completed request - only valid during the call
+*/
+void cq_post(struct completion_queue *q, struct buffer_descriptor *bd);
+
+/*
+ * Fill entries reserved by posters that died before publishing them with
+ * completions of id 0 - only while no poster is running (see ring_recover)
+ * @param q the queue
+*/
+void cq_repair(struct completion_queue *q);
+
+/*
+ * Reap completions in the order they were posted - single consumer
+ * @param q the queue
+ * @param head the consumer's position, advanced past the reaped entries
+ * @param out array for up to max completions
+ * @return the number of completions reaped, 0 if none are ready
+*/
+int cq_reap(struct completion_queue *q, uint32_t *head, struct buffer_descriptor *out, int max);
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+#define LINE_LEN 256
+
+static int read_binary(FILE *f, size_t size, struct kv_pair **pairs, size_t *n) {
+	/* A pair cut short at the end is dropped */
+	*n = (size - strlen(SNAPSHOT_MAGIC)) / sizeof(struct kv_pair);
+	*pairs = malloc((*n > 0 ? *n : 1) * sizeof(struct kv_pair));
+	if (*pairs == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	*n = fread(*pairs, sizeof(struct kv_pair), *n, f);
+	return 0;
+}
+
+/* Only "put key value" lines - anything else in a workload is skipped */
+static int read_text(FILE *f, struct kv_pair **pairs, size_t *n) {
+	char line[LINE_LEN];
+	size_t cap = 1024;
+	*n = 0;
+	*pairs = malloc(cap * sizeof(struct kv_pair));
+	if (*pairs == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	while (fgets(line, LINE_LEN, f) != NULL) {
+		if (strncmp(line, "put ", 4))
+			continue;
+		char *end;
+		key_type k = strtoul(line + 4, &end, 10);
+		if (end == line + 4)
+			continue;
+		value_type v = strtoul(end, NULL, 10);
+		if (*n == cap) {
+			cap *= 2;
+			struct kv_pair *grown = realloc(*pairs, cap * sizeof(struct kv_pair));
+			if (grown == NULL) {
+				perror("realloc");
+				return -1;
+			}
+			*pairs = grown;
+		}
+		(*pairs)[*n].k = k;
+		(*pairs)[*n].v = v;
+		(*n)++;
+	}
+	return 0;
+}
+
+int snapshot_read(const char *path, struct kv_pair **pairs, size_t *n) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen snapshot");
+		return -1;
+	}
+	struct stat st;
+	char magic[sizeof(SNAPSHOT_MAGIC)] = { 0 };
+	if (fstat(fileno(f), &st) < 0) {
+		perror("fstat");
+		fclose(f);
+		return -1;
+	}
+
+	int rc;
+	if (fread(magic, 1, strlen(SNAPSHOT_MAGIC), f) == strlen(SNAPSHOT_MAGIC) && !strcmp(magic, SNAPSHOT_MAGIC)) {
+		rc = read_binary(f, st.st_size, pairs, n);
+	} else {
+		rewind(f);
+		rc = read_text(f, pairs, n);
+	}
+	fclose(f);
+	return rc;
+}
+
+int snapshot_write(const char *path, struct kv_pair *pairs, size_t n) {
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		perror("fopen snapshot");
+		return -1;
+	}
+	if (fwrite(SNAPSHOT_MAGIC, 1, strlen(SNAPSHOT_MAGIC), f) != strlen(SNAPSHOT_MAGIC) ||
+			fwrite(pairs, sizeof(struct kv_pair), n, f) != n) {
+		perror("fwrite snapshot");
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include "common.h"
+#include "ring_buffer.h"
+
+/* First bytes of a binary snapshot, followed by the kv_pairs themselves */
+#define SNAPSHOT_MAGIC "KVSNAP01"
+
+/*
+ * Read a snapshot - either binary (SNAPSHOT_MAGIC) or a workload file, of
+ * which only the put lines count
+ * @param pairs set to a malloc'ed array of the pairs, in file order
+ * @param n set to the number of pairs
+ * @return 0 on success, -1 otherwise
+*/
+int snapshot_read(const char *path, struct kv_pair **pairs, size_t *n);
+
+/*
+ * Write pairs as a binary snapshot
+ * @return 0 on success, -1 otherwise
+*/
+int snapshot_write(const char *path, struct kv_pair *pairs, size_t n);